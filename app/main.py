@@ -15,15 +15,28 @@ from holoviews.streams import Pipe        # for continuously streaming data to t
 from ParticleModel import MultithreadedParticleSystem  # our C++ model!
 
 
+def latest_frame() -> tuple[pd.DataFrame, pd.DataFrame]:
+    """Packs the latest frame published by the model into dataframes.
+
+    Frames are consistent snapshots taken at the end of a step, so reading
+    one never waits on the model stepping in the background.
+
+    Returns:
+        DataFrames of the particles (x, y, m) and of the quadtree leaves
+        (x0, y0, x1, y1)
+    """
+    positions, masses, extents = model.frame()
+    particle_data = pd.DataFrame({'x': positions[:, 0], 'y': positions[:, 1], 'm': masses})
+    extent_data = pd.DataFrame(extents, columns=['x0', 'y0', 'x1', 'y1'])
+    return particle_data, extent_data
+
 def update_model() -> None:
     """Callback that is executed by periodic callback managed by the dashboard.
     
-    Update the model by a single step using the time delta. Once updated the
-    model data is packed into a dataframe and sent through the pipe.
+    The model steps on its own background thread; the latest completed step
+    is packed into a dataframe and sent through the pipe.
     """
-    model.update()
-    particle_data = pd.DataFrame([[particle.x, particle.y, particle.m] for particle in model.particles], columns=['x','y','m'])
-    extent_data = pd.DataFrame([extent for extent in model.get_extents()], columns=['x0', 'y0', 'x1', 'y1'])
+    particle_data, extent_data = latest_frame()
     particle_pipe.send((particle_data, extent_data))
     table.value = particle_data
 
@@ -60,9 +73,10 @@ def visualize_model(data) -> hv.core.overlay.Overlay:
 def play(event: pr.parameterized.Event) -> None:
     """Callback to play the simulation.
 
-    Configures a periodic callback to execute our update_model callback
-    approximately 30 frames-per-second. If the callback is already scheduled
-    then disable it. Also changes the button name to indicate the state.
+    Starts stepping the model in the background and configures a periodic
+    callback to execute our update_model callback approximately 30
+    frames-per-second. If the callback is already scheduled then stop both.
+    Also changes the button name to indicate the state.
 
     Arguments:
         event: the click event that triggered the callback
@@ -70,15 +84,17 @@ def play(event: pr.parameterized.Event) -> None:
     global periodic_callback
     if periodic_callback is None or not periodic_callback.running:
         play_button.name = 'Stop'
-        # set the periodic to call our run_model callback at 30 frames per second
+        # step the model at the frame rate without holding up the server, and set the
+        # periodic to call our run_model callback at 30 frames per second
+        model.start(fps_slider.value, steps_per_frame_slider.value)
         periodic_callback = pn.state.add_periodic_callback(update_model, period=1000//fps_slider.value)
         table.disabled = True
     elif periodic_callback.running:
         play_button.name = 'Play'
         periodic_callback.stop()
+        model.stop()
         table.disabled = False
-        particle_data = pd.DataFrame([[particle.x, particle.y, particle.m] for particle in model.particles], columns=['x','y','m'])
-        extent_data = pd.DataFrame([extent for extent in model.get_extents()], columns=['x0', 'y0', 'x1', 'y1'])
+        particle_data, extent_data = latest_frame()
         particle_pipe.send((particle_data, extent_data))
 
 def reset(event: pr.parameterized.Event | None) -> None:
@@ -96,14 +112,17 @@ def reset(event: pr.parameterized.Event | None) -> None:
         play_button.name = 'Play'
         periodic_callback.stop()
     periodic_callback = None
-    num_particles = num_particles_slider.value * thread_count_slider.value
-    model = MultithreadedParticleSystem(num_particles, bounds_slider.value, seed_input.value, theta_slider.value, time_delta_slider.value, thread_count_slider.value)
-    for particle in model.particles:
-        r = np.hypot(particle.x, particle.y)
-        if r > 1.0e-8:
-            particle.vx = -particle.y / r
-            particle.vy = particle.x / r
-    particle_data = pd.DataFrame([[particle.x, particle.y, particle.m] for particle in model.particles], columns=['x','y','m'])
+    if model is not None:
+        model.stop()
+    model = MultithreadedParticleSystem(num_particles_slider.value, bounds_slider.value, seed_input.value, theta_slider.value, time_delta_slider.value, thread_count_slider.value)
+    model.bucket_size = bucket_size_slider.value
+    # the attribute arrays are views of the model's memory, so writing to them sets the state
+    x, y = model.x, model.y
+    r = np.hypot(x, y)
+    moving = r > 1.0e-8
+    model.vx[moving] = -y[moving] / r[moving]
+    model.vy[moving] = x[moving] / r[moving]
+    particle_data, _ = latest_frame()
     extent_data = pd.DataFrame({
         'x0':[-bounds_slider.value],
         'y0':[-bounds_slider.value],
@@ -122,13 +141,13 @@ def open_readme(event):
 
 def edit_model(event):
     if event.column == 'x':
-        model.particles[event.row].x = event.value
+        model.x[event.row] = event.value
     elif event.column == 'y':
-        model.particles[event.row].y = event.value
+        model.y[event.row] = event.value
     elif event.column == 'm':
-        model.particles[event.row].m = event.value
-    particle_data = pd.DataFrame([[particle.x, particle.y, particle.m] for particle in model.particles], columns=['x','y','m'])
-    extent_data = pd.DataFrame([extent for extent in model.get_extents()], columns=['x0', 'y0', 'x1', 'y1'])
+        model.m[event.row] = event.value
+    model.publish()
+    particle_data, extent_data = latest_frame()
     particle_pipe.send((particle_data, extent_data))
 
 # create a global for the model
@@ -159,16 +178,18 @@ open_readme_button.on_click(open_readme)
 
 # input widgets for various options
 seed_input = pn.widgets.IntInput(name='Random Seed', value=1337)
-num_particles_slider = pn.widgets.FloatSlider(name='Particles per Thread', start=1, end=1000, step=1, value=100)
+num_particles_slider = pn.widgets.IntSlider(name='Particles', start=1, end=20000, step=1, value=1000)
 bounds_slider = pn.widgets.FloatSlider(name='Bounds', start=25, end=2500, value=100, step=25)
 time_delta_slider = pn.widgets.FloatSlider(name='Time Delta (s)', start=0.1, end=1.0, value=0.1, step=0.1)
 
 theta_slider = pn.widgets.FloatSlider(name='Theta', start=0.0, end=2.0, value=0.5, step=0.1)
+bucket_size_slider = pn.widgets.IntSlider(name='Leaf Bucket Size', start=1, end=64, value=1, step=1)
 
 thread_count = [2 ** i for i in range(int(np.log2(os.cpu_count())))]
 thread_count_slider = pn.widgets.DiscreteSlider(name='Thread Count', options=thread_count)
 
 fps_slider = pn.widgets.IntSlider(name='FPS', start=1, end=60, value=30, step=1)
+steps_per_frame_slider = pn.widgets.IntSlider(name='Steps per Frame', start=1, end=20, value=1, step=1)
 quadtree_display = pn.widgets.Toggle(name='Display Quadtree', sizing_mode='stretch_width')
 auto_scale_axes = pn.widgets.Toggle(name='Auto Scale Axes', sizing_mode='stretch_width')
 
@@ -196,7 +217,7 @@ This dashboard visualizes a multithreaded C++ implementation of a Barnes-Hut sim
 
 ### Controls
 
-* `Particles per Thread`: Number of particles to spawn per thread utilized.
+* `Particles`: Number of particles to spawn; any count works with any number of threads.
 * `Bounds`: Initial bounds to spawn particles within (lower left and upper right taken as (-b, -b) and (b, b)).
 * `Time Delta (s)`: The size of the time step to use for integration
 
@@ -204,11 +225,13 @@ This dashboard visualizes a multithreaded C++ implementation of a Barnes-Hut sim
 
 * `Random Seed`: The initial random seed
 * `Theta`: Barnes-Hut control parameter; lower values improve accuracy but decrease performance. Default of 0.5 provides great balance of realism and performance.
+* `Leaf Bucket Size`: Maximum number of particles held by a quadtree leaf; particles within a leaf interact directly. Larger buckets give a shallower tree.
 * `Thread Count`: Number of threads to use
 
 ---
 
-* `FPS`: Frames-Per-Second, or how fastthe playback is. If this is faster than the model, then stuttering will occur.
+* `FPS`: Frames-Per-Second, or how fast the playback is. The model steps at this rate on a background thread and each frame shows the latest completed step; if this is faster than the model, frames repeat.
+* `Steps per Frame`: Number of time steps the model advances between frames; only the last one is shown, fast-forwarding the simulation.
 * `Display Quadtree`: Render the quadtree subdivisions.
 * `Play`: Play the simulation with the current configuration, or unpause the simulation (turns to `Stop`).
 * `Stop`: Pause the currently running simulation (turns to `Play`).
@@ -246,11 +269,13 @@ app = pn.template.BootstrapTemplate(
             pn.panel('Performance Options'),
             seed_input,
             theta_slider,
+            bucket_size_slider,
             thread_count_slider
         ),
         pn.WidgetBox(
             pn.panel('Playback Options'),
             fps_slider,
+            steps_per_frame_slider,
             pn.Row(quadtree_display, width=321),
             pn.Row(play_button, reset_button, width=321)
         )
@@ -1,61 +1,445 @@
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 namespace py = pybind11;
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
 #include "particle_system.h"
-#include "syncable.h"
+#include "task_pool.h"
+
 
+template <typename Scalar>
+struct MultithreadedParticleSystem : ParticleSystem<Scalar> {
+    using Base = ParticleSystem<Scalar>;
+    using typename Base::Task;
+    using Base::active;
+    using Base::advance;
+    using Base::balance;
+    using Base::build_tree;
+    using Base::collect_active_forces;
+    using Base::collect_escaper_forces;
+    using Base::collect_forces;
+    using Base::collect_group_forces;
+    using Base::collect_multipole_forces;
+    using Base::concurrency;
+    using Base::escapers;
+    using Base::group_size;
+    using Base::parallel;
+    using Base::qt;
+    using Base::solver;
+    using Base::splits;
+    using Base::_multipole;
 
-struct MultithreadedParticleSystem : ParticleSystem {
-    MultithreadedParticleSystem(const int num_particles, const double bounds, const int seed, const double theta, const double dt, const std::size_t num_threads):
-        ParticleSystem(num_particles, bounds, theta, seed),
+    MultithreadedParticleSystem(const int num_particles, const double bounds, const int seed, const double theta, const double dt, const std::size_t num_threads, const Solver method = Solver::barnes_hut):
+        Base(num_particles, bounds, theta, seed),
         delta_time(dt),
         pool(num_threads)
     {
-        auto slice_size = num_particles / num_threads;
-        for (int i = 0; i < num_threads; ++i)
+        solver = method;
+        concurrency = pool.num_threads;
+        parallel = [this](const std::size_t count, const Task &task) {
+            pool.parallel_for(count, task);
+        };
+    }
+
+    ~MultithreadedParticleSystem()
+    {
+        stop();
+    }
+
+    /**
+     * Advances the simulation by a single step. Waits for a step in progress on the background
+     * thread, if any.
+     */
+    void update()
+    {
+        std::lock_guard guard(state_mutex);
+        step();
+    }
+
+    /**
+     * Advances the simulation by several steps in one call, without interleaving steps of the
+     * background thread.
+     *
+     * Arguments:
+     *     steps: number of steps to take
+     *     final_frame_only: publish a frame for the last step only, skipping the copies of the
+     *                       intermediate states
+     */
+    void update_n(const std::size_t steps, const bool final_frame_only = false)
+    {
+        std::lock_guard guard(state_mutex);
+        for (std::size_t i = 0; i < steps; ++i)
         {
-            callables.emplace_back(
-                std::bind(
-                    &ParticleSystem::collect_forces,
-                    std::ref(*this),
-                    i * slice_size,
-                    slice_size
-                )
-            );
+            step(!final_frame_only || i + 1 == steps);
         }
-        pool.initialize(callables);
     }
 
-    void update() {
-        build_tree();
-        pool.trigger();
-        integrate(delta_time);
+    /**
+     * Advances the simulation on a background thread until MultithreadedParticleSystem::stop is
+     * called. Settings and particle views must only be changed while stopped; the published
+     * frames can be read at any time.
+     *
+     * Arguments:
+     *     frames_per_second: rate to advance at; frames run back to back if zero or negative
+     *     steps_per_frame: steps taken per frame, of which only the last is published
+     */
+    void start(const double frames_per_second, const std::size_t steps_per_frame = 1)
+    {
+        stop();
+        stepper = std::jthread([this, frames_per_second, steps_per_frame](std::stop_token stop_token) {
+            using clock = std::chrono::steady_clock;
+            const auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(frames_per_second > 0.0 ? 1.0 / frames_per_second : 0.0));
+            std::mutex pacing;
+            std::condition_variable_any wakeup;
+            auto next = clock::now();
+            while (!stop_token.stop_requested())
+            {
+                update_n(steps_per_frame, true);
+                // a frame running late starts the next period from now rather than catching up
+                next = std::max(next + period, clock::now());
+                std::unique_lock lock(pacing);
+                wakeup.wait_until(lock, stop_token, next, [] { return false; });
+            }
+        });
+    }
+
+    /**
+     * Stops the background stepping started by MultithreadedParticleSystem::start, returning once
+     * the step in progress has completed.
+     */
+    void stop()
+    {
+        if (stepper.joinable())
+        {
+            stepper.request_stop();
+            stepper.join();
+        }
+    }
+
+    bool running() const
+    {
+        return stepper.joinable();
+    }
+
+    void step(const bool publish_frame = true)
+    {
+        advance(delta_time, [this]() { accelerate(); }, [this]() {
+            pool.parallel_chunks(active.size(), grain(active.size()), [this](const std::size_t begin, const std::size_t end) {
+                collect_active_forces(begin, end - begin);
+            });
+        }, publish_frame);
         simulation_time += delta_time;
     }
 
-    std::vector<std::function<void(void)>> callables;
+    /**
+     * Builds the tree at the current positions and adds the accelerations of every particle with
+     * the selected solver.
+     */
+    void accelerate()
+    {
+        build_tree();
+        if (_multipole())
+        {
+            collect_multipole_forces();
+        }
+        else if (group_size > 0)
+        {
+            pool.parallel_chunks(qt.groups.size(), grain(qt.groups.size()), [this](const std::size_t begin, const std::size_t end) {
+                collect_group_forces(begin, end - begin);
+            });
+        }
+        else
+        {
+            // a few ranges per thread leave stealing to absorb what the previous costs mispredict
+            balance(ranges_per_thread * pool.num_threads);
+            pool.parallel_for(splits.size() - 1, [this](const std::size_t i) {
+                collect_forces(splits[i], splits[i + 1] - splits[i]);
+            });
+        }
+        if (!escapers.empty())
+        {
+            collect_escaper_forces();
+        }
+    }
+
+    /**
+     * Number of items per chunk of a dynamically scheduled loop: the grain size if set, or
+     * enough chunks for each thread to take several if unset.
+     *
+     * Arguments:
+     *     count: number of items in the loop
+     */
+    std::size_t grain(const std::size_t count) const
+    {
+        if (grain_size > 0)
+        {
+            return grain_size;
+        }
+        return std::max<std::size_t>(1, count / (chunks_per_thread * pool.num_threads));
+    }
+
     double simulation_time = 0.0;
     double delta_time = 1.0;
+    static constexpr std::size_t ranges_per_thread = 4;  // cost-balanced tasks of the per-particle walk
+    static constexpr std::size_t chunks_per_thread = 16;  // chunks of a loop per thread by default
+    std::size_t grain_size = 0;                           // items per dynamically scheduled chunk; 0 derives it per loop
 
-    Syncable pool;
+    TaskPool pool;
+    std::mutex state_mutex;  // held for a whole step
+    std::jthread stepper;    // background stepping thread while running
 };
 
-PYBIND11_MODULE(ParticleModel, m) {
-    py::class_<MultithreadedParticleSystem>(m, "MultithreadedParticleSystem")
-        .def(py::init<const int, const double, const int, const double, const double, const std::size_t>())
-        .def("update", &MultithreadedParticleSystem::update)
-        .def("get_extents", &MultithreadedParticleSystem::get_extents)
-        .def_readwrite("ll", &MultithreadedParticleSystem::ll)
-        .def_readwrite("ur", &MultithreadedParticleSystem::ur)
-        .def_readwrite("simulation_time", &MultithreadedParticleSystem::simulation_time)
-        .def_readwrite("particles", &MultithreadedParticleSystem::particles);
-
-    py::class_<Particle>(m, "Particle")
-        .def_readwrite("x", &Particle::x)
-        .def_readwrite("y", &Particle::y)
-        .def_readwrite("vx", &Particle::vx)
-        .def_readwrite("vy", &Particle::vy)
-        .def_readwrite("m", &Particle::m);
+/**
+ * Accuracy and speed of a float run against a double run of the same state and settings.
+ */
+struct PrecisionReport
+{
+    double force_error {0.0};      // summed |a_float - a_double| over summed |a_double| at the start
+    double max_force_error {0.0};  // largest |a_float - a_double| / |a_double| of a particle
+    double position_error {0.0};   // rms distance between the runs at the end, over the rms radius
+    double seconds_double {0.0};   // wall time of the steps in double precision
+    double seconds_float {0.0};    // wall time of the steps in single precision
+};
+
+/**
+ * Runs a copy of a model in double and in single precision side by side and compares them: the
+ * accelerations both evaluate at the model's positions, the positions both reach after a number
+ * of steps, and the time they take for those steps. The model itself is left untouched.
+ *
+ * Arguments:
+ *     model: model whose particles and settings both runs start from
+ *     steps: number of steps to take
+ */
+PrecisionReport precision_report(MultithreadedParticleSystem<double> &model, const std::size_t steps)
+{
+    std::lock_guard guard(model.state_mutex);
+    MultithreadedParticleSystem<double> reference(1, 1.0, 0, model.theta, model.delta_time, model.pool.num_threads, model.solver);
+    MultithreadedParticleSystem<float> single(1, 1.0, 0, model.theta, model.delta_time, model.pool.num_threads, model.solver);
+    reference.assign(model);
+    single.assign(model);
+
+    auto accelerate = [](auto &system) {
+        system.particles.ax.assign(system.particles.size(), 0.0);
+        system.particles.ay.assign(system.particles.size(), 0.0);
+        system.accelerate();
+    };
+    accelerate(reference);
+    accelerate(single);
+
+    PrecisionReport report;
+    const auto n = model.particles.size();
+    const auto &p = reference.particles;
+    const auto &q = single.particles;
+    double error = 0.0;
+    double norm = 0.0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const double a = std::hypot(p.ax[i], p.ay[i]);
+        const double e = std::hypot(q.ax[i] - p.ax[i], q.ay[i] - p.ay[i]);
+        error += e;
+        norm += a;
+        if (a > 0.0)
+        {
+            report.max_force_error = std::max(report.max_force_error, e / a);
+        }
+    }
+    report.force_error = norm > 0.0 ? error / norm : 0.0;
+
+    auto run = [steps](auto &system) {
+        // every integrator starts from the forces just evaluated
+        system._forces_current = true;
+        const auto start = std::chrono::steady_clock::now();
+        system.update_n(steps, true);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    report.seconds_double = run(reference);
+    report.seconds_float = run(single);
+
+    std::array<double, 2> mean {0.0, 0.0};
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        mean = {mean[0] + p.x[i], mean[1] + p.y[i]};
+    }
+    mean = {mean[0] / n, mean[1] / n};
+    double distance = 0.0;
+    double radius = 0.0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const double dx = q.x[i] - p.x[i];
+        const double dy = q.y[i] - p.y[i];
+        distance += dx * dx + dy * dy;
+        radius += (p.x[i] - mean[0]) * (p.x[i] - mean[0]) + (p.y[i] - mean[1]) * (p.y[i] - mean[1]);
+    }
+    report.position_error = radius > 0.0 ? std::sqrt(distance / radius) : 0.0;
+    return report;
 }
 
+/**
+ * Exposes one attribute of every particle as a numpy array sharing the memory of the model, which
+ * is kept alive as the base of the array. The number of particles is fixed at construction, so
+ * the view stays valid and reflects every update. Views are not synchronized with the background
+ * stepping and should only be used while the model is stopped.
+ */
+template <typename Scalar, std::vector<Scalar> Particles<Scalar>::*Attribute>
+py::array_t<Scalar> particle_view(py::object self)
+{
+    auto &values = self.cast<MultithreadedParticleSystem<Scalar> &>().particles.*Attribute;
+    return py::array_t<Scalar>(static_cast<py::ssize_t>(values.size()), values.data(), self);
+}
+
+/**
+ * Copies the positions of a frame into a new (n, 2) numpy array.
+ */
+template <typename Scalar>
+py::array_t<Scalar> positions(const Frame<Scalar> &frame)
+{
+    // without a base object the constructor copies the buffer
+    return py::array_t<Scalar>(std::vector<py::ssize_t> {static_cast<py::ssize_t>(frame.masses.size()), 2}, frame.positions.data());
+}
+
+template <typename Scalar>
+py::array_t<Scalar> masses(const Frame<Scalar> &frame)
+{
+    return py::array_t<Scalar>(static_cast<py::ssize_t>(frame.masses.size()), frame.masses.data());
+}
+
+/**
+ * Copies the extents of the occupied quadtree leaves of a frame into a new (n, 4) numpy array
+ * with rows x0, y0, x1, y1.
+ */
+template <typename Scalar>
+py::array_t<double> extents(const Frame<Scalar> &frame)
+{
+    return py::array_t<double>(std::vector<py::ssize_t> {static_cast<py::ssize_t>(frame.extents.size()), 4}, reinterpret_cast<const double *>(frame.extents.data()));
+}
+
+/**
+ * Binds a setting the forces or the tree they are walked on depend on as a property. Assigning it
+ * discards the forces kept by the leapfrog integrators, so the next step evaluates them afresh
+ * under the new setting.
+ *
+ * Arguments:
+ *     cls: class to add the property to
+ *     name: name of the property
+ */
+template <auto Member, typename System>
+void def_force_setting(py::class_<System> &cls, const char *name)
+{
+    using Value = std::remove_reference_t<decltype(std::declval<System &>().*Member)>;
+    cls.def_property(name, [](const System &self) { return self.*Member; }, [](System &self, const Value value) {
+        self.*Member = value;
+        self._forces_current = false;
+    });
+}
+
+/**
+ * Binds the model of one scalar type as a Python class.
+ *
+ * Arguments:
+ *     m: module to add the class to
+ *     name: name of the class
+ */
+template <typename Scalar>
+void bind_system(py::module_ &m, const char *name)
+{
+    using System = MultithreadedParticleSystem<Scalar>;
+    py::class_<System> cls(m, name);
+    cls.def(py::init<const int, const double, const int, const double, const double, const std::size_t, const Solver>(),
+            py::arg("num_particles"), py::arg("bounds"), py::arg("seed"), py::arg("theta"), py::arg("dt"), py::arg("num_threads"),
+            py::arg("solver") = Solver::barnes_hut)
+        .def("update", &System::update, py::call_guard<py::gil_scoped_release>())
+        .def("update_n", &System::update_n, py::arg("steps"), py::arg("final_frame_only") = false, py::call_guard<py::gil_scoped_release>())
+        .def("start", &System::start, py::arg("frames_per_second") = 0.0, py::arg("steps_per_frame") = 1, py::call_guard<py::gil_scoped_release>())
+        .def("stop", &System::stop, py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("running", &System::running)
+        // snapshots of the latest completed step, which never wait on the background stepping;
+        // the frame is only swapped while holding the GIL, so Python is its single reader
+        .def("frame", [](System &self) {
+            const auto &frame = self.frames.front();
+            return py::make_tuple(positions(frame), masses(frame), extents(frame));
+        })
+        .def("positions", [](System &self) { return positions(self.frames.front()); })
+        .def("masses", [](System &self) { return masses(self.frames.front()); })
+        .def("get_extents", [](System &self) { return extents(self.frames.front()); })
+        // called after editing the particle views, so the forces kept by the leapfrog integrators
+        // are evaluated afresh at the edited positions
+        .def("publish", [](System &self) {
+            std::lock_guard guard(self.state_mutex);
+            self._forces_current = false;
+            self.publish();
+        }, py::call_guard<py::gil_scoped_release>())
+        .def_readwrite("publish_extents", &System::publish_extents)
+        .def_readwrite("ll", &System::ll)
+        .def_readwrite("ur", &System::ur)
+        .def_readwrite("bucket_size", &System::bucket_size)
+        .def_readwrite("max_depth", &System::max_depth)
+        .def_readwrite("integrator", &System::integrator)
+        .def_readwrite("timestep_displacement", &System::timestep_displacement)
+        .def_readwrite("group_size", &System::group_size)
+        .def_readwrite("grain_size", &System::grain_size)
+        .def_readwrite("escape_sigmas", &System::escape_sigmas)
+        .def_readwrite("tree_builder", &System::tree_builder)
+        .def_readwrite("simulation_time", &System::simulation_time)
+        .def_property_readonly("x", &particle_view<Scalar, &Particles<Scalar>::x>)
+        .def_property_readonly("y", &particle_view<Scalar, &Particles<Scalar>::y>)
+        .def_property_readonly("vx", &particle_view<Scalar, &Particles<Scalar>::vx>)
+        .def_property_readonly("vy", &particle_view<Scalar, &Particles<Scalar>::vy>)
+        .def_property_readonly("m", &particle_view<Scalar, &Particles<Scalar>::m>)
+        .def_property_readonly("q", &particle_view<Scalar, &Particles<Scalar>::q>);
+    def_force_setting<&System::multipole_order>(cls, "multipole_order");
+    def_force_setting<&System::solver>(cls, "solver");
+    def_force_setting<&System::force_law>(cls, "force_law");
+    def_force_setting<&System::softening>(cls, "softening");
+    def_force_setting<&System::softening_length>(cls, "softening_length");
+    def_force_setting<&System::expansion_order>(cls, "expansion_order");
+    def_force_setting<&System::timestep_levels>(cls, "timestep_levels");
+}
+
+PYBIND11_MODULE(ParticleModel, m) {
+    py::enum_<TreeBuilder>(m, "TreeBuilder")
+        .value("insertion", TreeBuilder::insertion)
+        .value("morton", TreeBuilder::morton);
+
+    py::enum_<MultipoleOrder>(m, "MultipoleOrder")
+        .value("monopole", MultipoleOrder::monopole)
+        .value("quadrupole", MultipoleOrder::quadrupole);
+
+    py::enum_<Solver>(m, "Solver")
+        .value("barnes_hut", Solver::barnes_hut)
+        .value("fast_multipole", Solver::fast_multipole);
+
+    py::enum_<ForceLaw>(m, "ForceLaw")
+        .value("newtonian", ForceLaw::newtonian)
+        .value("logarithmic", ForceLaw::logarithmic)
+        .value("coulomb", ForceLaw::coulomb);
+
+    py::enum_<Softening>(m, "Softening")
+        .value("none", Softening::none)
+        .value("plummer", Softening::plummer)
+        .value("spline", Softening::spline);
+
+    py::enum_<Integrator>(m, "Integrator")
+        .value("euler", Integrator::euler)
+        .value("leapfrog", Integrator::leapfrog)
+        .value("yoshida", Integrator::yoshida);
+
+    bind_system<double>(m, "MultithreadedParticleSystem");
+    bind_system<float>(m, "MultithreadedParticleSystem32");
+
+    py::class_<PrecisionReport>(m, "PrecisionReport")
+        .def_readonly("force_error", &PrecisionReport::force_error)
+        .def_readonly("max_force_error", &PrecisionReport::max_force_error)
+        .def_readonly("position_error", &PrecisionReport::position_error)
+        .def_readonly("seconds_double", &PrecisionReport::seconds_double)
+        .def_readonly("seconds_float", &PrecisionReport::seconds_float);
+
+    m.def("precision_report", &precision_report, py::arg("model"), py::arg("steps") = 10, py::call_guard<py::gil_scoped_release>());
+}
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "particle.h"
+#include "quadtree.h"
+
+constexpr int max_expansion_order = 10;
+
+/**
+ * Fast multipole solver on top of the quadtree decomposition. Each node carries a multipole
+ * expansion of its particles and a local expansion of the field of well-separated nodes, both
+ * Cartesian Taylor series of the 1/r potential in x and y about the node's center of gravity.
+ *
+ * Interactions are found with a dual-tree traversal per target subtree of the quadtree frontier.
+ * Every task only writes to the expansions and particles of its own subtree, so the traversal,
+ * the downward pass and the evaluation at the particles all run in parallel. Expansions are kept in
+ * double precision whatever the scalar type of the particles.
+ */
+template <typename Scalar>
+struct FastMultipole
+{
+    int order = 4;
+    std::size_t num_coeffs = 15;       // number of (a, b) with a + b <= order
+    std::vector<int> powers_x;         // a of each coefficient
+    std::vector<int> powers_y;         // b of each coefficient
+    std::vector<double> multipoles;    // node-major multipole coefficients M(a, b)
+    std::vector<double> locals;        // node-major local coefficients L(a, b)
+    std::vector<double> radii;         // distance from the center of each node to its farthest corner
+    const QuadTree<Scalar> *tree {nullptr};
+    double theta = 0.5;
+
+    static constexpr std::size_t _index(const int a, const int b)
+    {
+        return static_cast<std::size_t>((a + b) * (a + b + 1) / 2 + b);
+    }
+
+    /**
+     * Computes the accelerations of every particle in the tree. Centers of gravity and the
+     * frontier of the tree must be up to date.
+     *
+     * Arguments:
+     *     qt: tree to evaluate
+     *     expansion_order: highest total power of the expansions
+     *     opening: maximum ratio of the summed radii of two nodes to their distance for them to
+     *              interact through expansions
+     *     parallel: callable executing task(i) for every i in [0, count)
+     */
+    template <typename Parallel>
+    void evaluate(const QuadTree<Scalar> &qt, const int expansion_order, const double opening, Parallel &&parallel)
+    {
+        tree = &qt;
+        theta = opening;
+        _set_order(std::clamp(expansion_order, 1, max_expansion_order));
+
+        const auto num_nodes = tree->nodes.size();
+        multipoles.assign(num_nodes * num_coeffs, 0.0);
+        locals.assign(num_nodes * num_coeffs, 0.0);
+        radii.resize(num_nodes);
+
+        parallel(tree->frontier.size(), [this](const std::size_t i) {
+            _upward(tree->frontier[i]);
+        });
+        for (auto it = tree->top.rbegin(); it != tree->top.rend(); ++it)
+        {
+            _gather(*it);
+        }
+
+        parallel(tree->frontier.size(), [this](const std::size_t i) {
+            const auto target = tree->frontier[i];
+            _interact(target, 0);
+            _downward(target);
+        });
+    }
+
+    void _set_order(const int p)
+    {
+        order = p;
+        num_coeffs = _index(0, p) + 1;
+        powers_x.resize(num_coeffs);
+        powers_y.resize(num_coeffs);
+        for (int n = 0; n <= p; ++n)
+        {
+            for (int b = 0; b <= n; ++b)
+            {
+                powers_x[_index(n - b, b)] = n - b;
+                powers_y[_index(n - b, b)] = b;
+            }
+        }
+    }
+
+    /**
+     * Fills t[i] with x^a * y^b / (a! * b!) for every coefficient i.
+     */
+    void _monomials(const double x, const double y, double *t) const
+    {
+        std::array<double, max_expansion_order + 1> px;
+        std::array<double, max_expansion_order + 1> py;
+        px[0] = 1.0;
+        py[0] = 1.0;
+        for (int k = 1; k <= order; ++k)
+        {
+            px[k] = px[k - 1] * x / k;
+            py[k] = py[k - 1] * y / k;
+        }
+        for (std::size_t i = 0; i < num_coeffs; ++i)
+        {
+            t[i] = px[powers_x[i]] * py[powers_y[i]];
+        }
+    }
+
+    /**
+     * Fills d[i] with the derivative d^a/dx^a d^b/dy^b of 1/r at (x, y) for every coefficient i,
+     * using the recurrence on f_k = (1/r d/dr)^k 1/r: R(k; a + 1, b) = x R(k + 1; a, b) +
+     * a R(k + 1; a - 1, b), and likewise in y.
+     */
+    void _derivatives(const double x, const double y, double *d) const
+    {
+        constexpr std::size_t size = _index(0, max_expansion_order) + 1;
+        std::array<std::array<double, size>, max_expansion_order + 1> r;
+
+        double r2 = x * x + y * y;
+        r[0][0] = 1.0 / std::sqrt(r2);
+        for (int k = 0; k < order; ++k)
+        {
+            r[k + 1][0] = -(2 * k + 1) * r[k][0] / r2;
+        }
+        for (int n = 1; n <= order; ++n)
+        {
+            for (int k = 0; k <= order - n; ++k)
+            {
+                for (int b = 0; b <= n; ++b)
+                {
+                    int a = n - b;
+                    double value;
+                    if (a > 0)
+                    {
+                        value = x * r[k + 1][_index(a - 1, b)];
+                        if (a > 1)
+                        {
+                            value += (a - 1) * r[k + 1][_index(a - 2, b)];
+                        }
+                    }
+                    else
+                    {
+                        value = y * r[k + 1][_index(0, b - 1)];
+                        if (b > 1)
+                        {
+                            value += (b - 1) * r[k + 1][_index(0, b - 2)];
+                        }
+                    }
+                    r[k][_index(a, b)] = value;
+                }
+            }
+        }
+        std::copy_n(r[0].begin(), num_coeffs, d);
+    }
+
+    void _radius(const std::int32_t index)
+    {
+        const auto &node = tree->nodes[index];
+        double rx = std::max(node.center[0] - node.ll[0], node.ur[0] - node.center[0]);
+        double ry = std::max(node.center[1] - node.ll[1], node.ur[1] - node.center[1]);
+        radii[index] = std::hypot(rx, ry);
+    }
+
+    /**
+     * Multipole expansion of a subtree: particle to multipole at leaves, multipole to multipole
+     * towards the root.
+     */
+    void _upward(const std::int32_t index)
+    {
+        const auto &node = tree->nodes[index];
+        _radius(index);
+        if (node.is_leaf())
+        {
+            std::array<double, _index(0, max_expansion_order) + 1> t;
+            const auto &particles = *tree->particles;
+            auto *m = &multipoles[index * num_coeffs];
+            for (auto i = node.first; i < node.first + node.count; ++i)
+            {
+                const auto e = tree->items[i];
+                _monomials(node.center[0] - particles.x[e], node.center[1] - particles.y[e], t.data());
+                for (std::size_t c = 0; c < num_coeffs; ++c)
+                {
+                    m[c] += particles.m[e] * t[c];
+                }
+            }
+            return;
+        }
+        for (auto c : node.children)
+        {
+            if (c >= 0)
+            {
+                _upward(c);
+            }
+        }
+        _gather(index);
+    }
+
+    void _gather(const std::int32_t index)
+    {
+        // M(s; a) = sum over b <= a of (s - s')^(a - b) / (a - b)! M(s'; b)
+        std::array<double, _index(0, max_expansion_order) + 1> t;
+        const auto &node = tree->nodes[index];
+        _radius(index);
+        auto *m = &multipoles[index * num_coeffs];
+        for (auto c : node.children)
+        {
+            if (c < 0)
+            {
+                continue;
+            }
+            const auto &child = tree->nodes[c];
+            const auto *mc = &multipoles[c * num_coeffs];
+            _monomials(node.center[0] - child.center[0], node.center[1] - child.center[1], t.data());
+            for (std::size_t i = 0; i < num_coeffs; ++i)
+            {
+                for (std::size_t j = 0; j < num_coeffs; ++j)
+                {
+                    int a = powers_x[i] - powers_x[j];
+                    int b = powers_y[i] - powers_y[j];
+                    if (a >= 0 && b >= 0)
+                    {
+                        m[i] += t[_index(a, b)] * mc[j];
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Dual-tree traversal accumulating the field of source node onto the target node. Only the
+     * target side is written, so disjoint target subtrees can be traversed concurrently.
+     */
+    void _interact(const std::int32_t target, const std::int32_t source)
+    {
+        const auto &a = tree->nodes[target];
+        const auto &b = tree->nodes[source];
+        double dx = a.center[0] - b.center[0];
+        double dy = a.center[1] - b.center[1];
+        double d = std::hypot(dx, dy);
+
+        if (radii[target] + radii[source] < theta * d)
+        {
+            _translate(target, source, dx, dy);
+        }
+        else if (a.is_leaf() && b.is_leaf())
+        {
+            auto &particles = *tree->particles;
+            dispatch_kernel(tree->law, tree->softening, [&](auto kernel) {
+                using K = decltype(kernel);
+                for (auto i = a.first; i < a.first + a.count; ++i)
+                {
+                    const auto e = tree->items[i];
+                    const double coupling = K::coupling(particles, e);
+                    double ax = particles.ax[e];
+                    double ay = particles.ay[e];
+                    for (auto j = b.first; j < b.first + b.count; ++j)
+                    {
+                        const auto o = tree->items[j];
+                        double dx = particles.x[o] - particles.x[e];
+                        double dy = particles.y[o] - particles.y[e];
+                        if (dx != 0.0 || dy != 0.0)
+                        {
+                            point_force<K>(dx, dy, K::strength(particles, o), tree->softening_length, coupling, ax, ay);
+                        }
+                    }
+                    particles.ax[e] = static_cast<Scalar>(ax);
+                    particles.ay[e] = static_cast<Scalar>(ay);
+                }
+            });
+        }
+        else if (b.is_leaf() || (!a.is_leaf() && a.ur[0] - a.ll[0] > b.ur[0] - b.ll[0]))
+        {
+            for (auto c : a.children)
+            {
+                if (c >= 0)
+                {
+                    _interact(c, source);
+                }
+            }
+        }
+        else
+        {
+            for (auto c : b.children)
+            {
+                if (c >= 0)
+                {
+                    _interact(target, c);
+                }
+            }
+        }
+    }
+
+    void _translate(const std::int32_t target, const std::int32_t source, const double dx, const double dy)
+    {
+        // L(t; b) += -G sum over a of M(s; a) D^(a + b) (1/r)(t - s), truncated at a + b <= order
+        std::array<double, _index(0, max_expansion_order) + 1> d;
+        _derivatives(dx, dy, d.data());
+        const auto *m = &multipoles[source * num_coeffs];
+        auto *l = &locals[target * num_coeffs];
+        for (std::size_t i = 0; i < num_coeffs; ++i)
+        {
+            double sum = 0.0;
+            for (std::size_t j = 0; j < num_coeffs; ++j)
+            {
+                int a = powers_x[i] + powers_x[j];
+                int b = powers_y[i] + powers_y[j];
+                if (a + b <= order)
+                {
+                    sum += m[j] * d[_index(a, b)];
+                }
+            }
+            l[i] -= G * sum;
+        }
+    }
+
+    /**
+     * Shifts local expansions down a subtree (local to local) and evaluates them at the particles
+     * of its leaves (local to particle), where the acceleration is -grad of the local expansion.
+     */
+    void _downward(const std::int32_t index)
+    {
+        std::array<double, _index(0, max_expansion_order) + 1> t;
+        const auto &node = tree->nodes[index];
+        const auto *l = &locals[index * num_coeffs];
+        if (node.is_leaf())
+        {
+            auto &particles = *tree->particles;
+            for (auto i = node.first; i < node.first + node.count; ++i)
+            {
+                const auto e = tree->items[i];
+                _monomials(particles.x[e] - node.center[0], particles.y[e] - node.center[1], t.data());
+                double ax = particles.ax[e];
+                double ay = particles.ay[e];
+                for (std::size_t c = 0; c < num_coeffs; ++c)
+                {
+                    if (powers_x[c] + powers_y[c] < order)
+                    {
+                        ax -= l[_index(powers_x[c] + 1, powers_y[c])] * t[c];
+                        ay -= l[_index(powers_x[c], powers_y[c] + 1)] * t[c];
+                    }
+                }
+                particles.ax[e] = static_cast<Scalar>(ax);
+                particles.ay[e] = static_cast<Scalar>(ay);
+            }
+            return;
+        }
+        for (auto c : node.children)
+        {
+            if (c < 0)
+            {
+                continue;
+            }
+            // L(t'; g) += sum over b >= g of L(t; b) (t' - t)^(b - g) / (b - g)!
+            const auto &child = tree->nodes[c];
+            auto *lc = &locals[c * num_coeffs];
+            _monomials(child.center[0] - node.center[0], child.center[1] - node.center[1], t.data());
+            for (std::size_t i = 0; i < num_coeffs; ++i)
+            {
+                for (std::size_t j = 0; j < num_coeffs; ++j)
+                {
+                    int a = powers_x[j] - powers_x[i];
+                    int b = powers_y[j] - powers_y[i];
+                    if (a >= 0 && b >= 0)
+                    {
+                        lc[i] += l[j] * t[_index(a, b)];
+                    }
+                }
+            }
+            _downward(c);
+        }
+    }
+};
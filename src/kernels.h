@@ -0,0 +1,416 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BH_X86_KERNELS 1
+#define BH_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define BH_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+#include "particle.h"
+
+/**
+ * Batched evaluation of the point-source interactions of an interaction list. Every kernel adds
+ *
+ *     coupling * sum over i of (x[i] - x, y[i] - y) * K::radial(m[i], r^2, length)
+ *
+ * to (ax, ay), skipping sources at zero distance (the target itself or coincident particles).
+ * Kernels are instantiated per Kernel and scalar type of the sources, so each carries no trace of
+ * the other force laws and softenings, and float sources fill twice the lanes of double ones. The
+ * lanes are summed in double precision, as are the accelerations added to. The widest variant
+ * supported by the CPU is picked once at load time.
+ */
+template <typename Scalar>
+using ForceKernel = void (*)(const Scalar *sx, const Scalar *sy, const Scalar *sm, std::size_t n, Scalar x, Scalar y, double length, double coupling, double &ax, double &ay);
+
+template <typename K, typename Scalar>
+inline void force_kernel_scalar(const Scalar *sx, const Scalar *sy, const Scalar *sm, const std::size_t n, const Scalar x, const Scalar y, const double length, const double coupling, double &ax, double &ay)
+{
+    double fx = 0.0;
+    double fy = 0.0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        double dx = sx[i] - x;
+        double dy = sy[i] - y;
+        double d2 = dx * dx + dy * dy;
+        if (d2 > 0.0)
+        {
+            double f = K::radial(sm[i], d2, length);
+            fx += f * dx;
+            fy += f * dy;
+        }
+    }
+    ax += coupling * fx;
+    ay += coupling * fy;
+}
+
+#ifdef BH_X86_KERNELS
+
+/**
+ * AVX2 vectors of a scalar type and the operations the kernels take on them. Comparisons return
+ * lane masks of all bits set or clear.
+ */
+template <typename Scalar>
+struct Avx2;
+
+template <>
+struct Avx2<double>
+{
+    using V = __m256d;
+    static constexpr std::size_t width = 4;
+
+    BH_TARGET_AVX2 static V set1(const double v) { return _mm256_set1_pd(v); }
+    BH_TARGET_AVX2 static V zero() { return _mm256_setzero_pd(); }
+    BH_TARGET_AVX2 static V load(const double *p) { return _mm256_loadu_pd(p); }
+    BH_TARGET_AVX2 static V add(const V a, const V b) { return _mm256_add_pd(a, b); }
+    BH_TARGET_AVX2 static V sub(const V a, const V b) { return _mm256_sub_pd(a, b); }
+    BH_TARGET_AVX2 static V mul(const V a, const V b) { return _mm256_mul_pd(a, b); }
+    BH_TARGET_AVX2 static V div(const V a, const V b) { return _mm256_div_pd(a, b); }
+    BH_TARGET_AVX2 static V sqrt(const V a) { return _mm256_sqrt_pd(a); }
+    BH_TARGET_AVX2 static V fmadd(const V a, const V b, const V c) { return _mm256_fmadd_pd(a, b, c); }
+    BH_TARGET_AVX2 static V fmsub(const V a, const V b, const V c) { return _mm256_fmsub_pd(a, b, c); }
+    BH_TARGET_AVX2 static V greater(const V a, const V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    BH_TARGET_AVX2 static V less(const V a, const V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    BH_TARGET_AVX2 static V mask(const V a, const V lanes) { return _mm256_and_pd(a, lanes); }
+    BH_TARGET_AVX2 static V blend(const V a, const V b, const V lanes) { return _mm256_blendv_pd(a, b, lanes); }
+
+    /**
+     * Loads the first count < width elements, with the lanes of rest in the others.
+     */
+    BH_TARGET_AVX2 static V load_head(const double *p, const std::size_t count, const V rest)
+    {
+        const __m256i lanes = _mm256_cmpgt_epi64(_mm256_set1_epi64x(static_cast<long long>(count)), _mm256_set_epi64x(3, 2, 1, 0));
+        return _mm256_blendv_pd(rest, _mm256_maskload_pd(p, lanes), _mm256_castsi256_pd(lanes));
+    }
+
+    BH_TARGET_AVX2 static double sum(const V a)
+    {
+        alignas(32) double l[4];
+        _mm256_store_pd(l, a);
+        return (l[0] + l[1]) + (l[2] + l[3]);
+    }
+};
+
+template <>
+struct Avx2<float>
+{
+    using V = __m256;
+    static constexpr std::size_t width = 8;
+
+    BH_TARGET_AVX2 static V set1(const double v) { return _mm256_set1_ps(static_cast<float>(v)); }
+    BH_TARGET_AVX2 static V zero() { return _mm256_setzero_ps(); }
+    BH_TARGET_AVX2 static V load(const float *p) { return _mm256_loadu_ps(p); }
+    BH_TARGET_AVX2 static V add(const V a, const V b) { return _mm256_add_ps(a, b); }
+    BH_TARGET_AVX2 static V sub(const V a, const V b) { return _mm256_sub_ps(a, b); }
+    BH_TARGET_AVX2 static V mul(const V a, const V b) { return _mm256_mul_ps(a, b); }
+    BH_TARGET_AVX2 static V div(const V a, const V b) { return _mm256_div_ps(a, b); }
+    BH_TARGET_AVX2 static V sqrt(const V a) { return _mm256_sqrt_ps(a); }
+    BH_TARGET_AVX2 static V fmadd(const V a, const V b, const V c) { return _mm256_fmadd_ps(a, b, c); }
+    BH_TARGET_AVX2 static V fmsub(const V a, const V b, const V c) { return _mm256_fmsub_ps(a, b, c); }
+    BH_TARGET_AVX2 static V greater(const V a, const V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    BH_TARGET_AVX2 static V less(const V a, const V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    BH_TARGET_AVX2 static V mask(const V a, const V lanes) { return _mm256_and_ps(a, lanes); }
+    BH_TARGET_AVX2 static V blend(const V a, const V b, const V lanes) { return _mm256_blendv_ps(a, b, lanes); }
+
+    BH_TARGET_AVX2 static V load_head(const float *p, const std::size_t count, const V rest)
+    {
+        const __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(count)), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+        return _mm256_blendv_ps(rest, _mm256_maskload_ps(p, lanes), _mm256_castsi256_ps(lanes));
+    }
+
+    BH_TARGET_AVX2 static double sum(const V a)
+    {
+        alignas(32) float l[8];
+        _mm256_store_ps(l, a);
+        return ((double {l[0]} + l[1]) + (double {l[2]} + l[3])) + ((double {l[4]} + l[5]) + (double {l[6]} + l[7]));
+    }
+};
+
+/**
+ * Vector counterpart of over_cube for AVX2, zero in the lanes at zero distance.
+ */
+template <Softening S, typename Scalar>
+BH_TARGET_AVX2
+inline typename Avx2<Scalar>::V _over_cube_avx2(const typename Avx2<Scalar>::V m, const typename Avx2<Scalar>::V d2, const double length)
+{
+    using A = Avx2<Scalar>;
+    const auto nonzero = A::greater(d2, A::zero());
+    if constexpr (S == Softening::plummer)
+    {
+        const auto s2 = A::add(d2, A::set1(length * length));
+        return A::mask(A::div(m, A::mul(s2, A::sqrt(s2))), nonzero);
+    }
+    const auto r = A::sqrt(d2);
+    auto f = A::div(m, A::mul(d2, r));
+    if constexpr (S == Softening::spline)
+    {
+        // evaluate both pieces of the spline and blend them in below the support
+        const double h = spline_support * length;
+        const auto mh3 = A::mul(m, A::set1(1.0 / (h * h * h)));
+        const auto u = A::mul(r, A::set1(1.0 / h));
+        const auto u2 = A::mul(u, u);
+        const auto inner = A::fmadd(u2, A::fmsub(A::set1(32.0), u, A::set1(38.4)), A::set1(10.666666666667));
+        auto outer = A::fmadd(A::set1(-10.666666666667), u, A::set1(38.4));
+        outer = A::fmadd(outer, u, A::set1(-48.0));
+        outer = A::fmadd(outer, u, A::set1(21.333333333333));
+        outer = A::sub(outer, A::div(A::set1(0.066666666667), A::mul(u2, u)));
+        const auto piece = A::blend(outer, inner, A::less(u, A::set1(0.5)));
+        f = A::blend(f, A::mul(mh3, piece), A::less(u, A::set1(1.0)));
+    }
+    return A::mask(f, nonzero);
+}
+
+/**
+ * Vector counterpart of Kernel::radial for AVX2, zero in the lanes at zero distance.
+ */
+template <typename K, typename Scalar>
+BH_TARGET_AVX2
+inline typename Avx2<Scalar>::V _radial_avx2(const typename Avx2<Scalar>::V m, const typename Avx2<Scalar>::V d2, const double length)
+{
+    using A = Avx2<Scalar>;
+    if constexpr (K::law != ForceLaw::logarithmic)
+    {
+        return _over_cube_avx2<K::softening, Scalar>(m, d2, length);
+    }
+    else if constexpr (K::softening == Softening::spline)
+    {
+        return A::mul(A::sqrt(d2), _over_cube_avx2<Softening::spline, Scalar>(m, d2, length));
+    }
+    else
+    {
+        auto s2 = d2;
+        if constexpr (K::softening == Softening::plummer)
+        {
+            s2 = A::add(d2, A::set1(length * length));
+        }
+        return A::mask(A::div(m, s2), A::greater(d2, A::zero()));
+    }
+}
+
+template <typename K, typename Scalar>
+BH_TARGET_AVX2
+inline void _force_kernel_avx2_step(const typename Avx2<Scalar>::V px, const typename Avx2<Scalar>::V py, const typename Avx2<Scalar>::V pm, const typename Avx2<Scalar>::V vx, const typename Avx2<Scalar>::V vy, const double length, typename Avx2<Scalar>::V &fx, typename Avx2<Scalar>::V &fy)
+{
+    using A = Avx2<Scalar>;
+    auto dx = A::sub(px, vx);
+    auto dy = A::sub(py, vy);
+    auto d2 = A::fmadd(dx, dx, A::mul(dy, dy));
+    auto f = _radial_avx2<K, Scalar>(pm, d2, length);
+    fx = A::fmadd(f, dx, fx);
+    fy = A::fmadd(f, dy, fy);
+}
+
+template <typename K, typename Scalar>
+BH_TARGET_AVX2
+inline void force_kernel_avx2(const Scalar *sx, const Scalar *sy, const Scalar *sm, const std::size_t n, const Scalar x, const Scalar y, const double length, const double coupling, double &ax, double &ay)
+{
+    using A = Avx2<Scalar>;
+    const auto vx = A::set1(x);
+    const auto vy = A::set1(y);
+    auto fx = A::zero();
+    auto fy = A::zero();
+
+    std::size_t i = 0;
+    for (; i + A::width <= n; i += A::width)
+    {
+        _force_kernel_avx2_step<K, Scalar>(A::load(sx + i), A::load(sy + i), A::load(sm + i), vx, vy, length, fx, fy);
+    }
+    if (i < n)
+    {
+        // masked-off lanes take the position of the target, at zero distance, and contribute nothing
+        _force_kernel_avx2_step<K, Scalar>(A::load_head(sx + i, n - i, vx), A::load_head(sy + i, n - i, vy), A::load_head(sm + i, n - i, A::zero()), vx, vy, length, fx, fy);
+    }
+
+    ax += coupling * A::sum(fx);
+    ay += coupling * A::sum(fy);
+}
+
+/**
+ * AVX-512 vectors of a scalar type and the operations the kernels take on them. Comparisons return
+ * bit masks of the lanes, which the masked operations take to select their lanes.
+ */
+template <typename Scalar>
+struct Avx512;
+
+template <>
+struct Avx512<double>
+{
+    using V = __m512d;
+    using Mask = __mmask8;
+    static constexpr std::size_t width = 8;
+
+    BH_TARGET_AVX512 static V set1(const double v) { return _mm512_set1_pd(v); }
+    BH_TARGET_AVX512 static V zero() { return _mm512_setzero_pd(); }
+    BH_TARGET_AVX512 static V load(const Mask lanes, const double *p, const V rest) { return _mm512_mask_loadu_pd(rest, lanes, p); }
+    BH_TARGET_AVX512 static V add(const V a, const V b) { return _mm512_add_pd(a, b); }
+    BH_TARGET_AVX512 static V sub(const V a, const V b) { return _mm512_sub_pd(a, b); }
+    BH_TARGET_AVX512 static V mul(const V a, const V b) { return _mm512_mul_pd(a, b); }
+    BH_TARGET_AVX512 static V mul(const V src, const Mask lanes, const V a, const V b) { return _mm512_mask_mul_pd(src, lanes, a, b); }
+    BH_TARGET_AVX512 static V div(const V a, const V b) { return _mm512_div_pd(a, b); }
+    BH_TARGET_AVX512 static V div(const Mask lanes, const V a, const V b) { return _mm512_maskz_div_pd(lanes, a, b); }
+    BH_TARGET_AVX512 static V sqrt(const V a) { return _mm512_sqrt_pd(a); }
+    BH_TARGET_AVX512 static V fmadd(const V a, const V b, const V c) { return _mm512_fmadd_pd(a, b, c); }
+    BH_TARGET_AVX512 static V fmsub(const V a, const V b, const V c) { return _mm512_fmsub_pd(a, b, c); }
+    BH_TARGET_AVX512 static Mask greater(const V a, const V b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+    BH_TARGET_AVX512 static Mask less(const V a, const V b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+    BH_TARGET_AVX512 static V blend(const Mask lanes, const V a, const V b) { return _mm512_mask_blend_pd(lanes, a, b); }
+    BH_TARGET_AVX512 static double sum(const V a) { return _mm512_reduce_add_pd(a); }
+
+    /**
+     * Mask of the first min(count, width) lanes.
+     */
+    static Mask head(const std::size_t count)
+    {
+        return count >= width ? 0xff : static_cast<Mask>((1u << count) - 1);
+    }
+};
+
+template <>
+struct Avx512<float>
+{
+    using V = __m512;
+    using Mask = __mmask16;
+    static constexpr std::size_t width = 16;
+
+    BH_TARGET_AVX512 static V set1(const double v) { return _mm512_set1_ps(static_cast<float>(v)); }
+    BH_TARGET_AVX512 static V zero() { return _mm512_setzero_ps(); }
+    BH_TARGET_AVX512 static V load(const Mask lanes, const float *p, const V rest) { return _mm512_mask_loadu_ps(rest, lanes, p); }
+    BH_TARGET_AVX512 static V add(const V a, const V b) { return _mm512_add_ps(a, b); }
+    BH_TARGET_AVX512 static V sub(const V a, const V b) { return _mm512_sub_ps(a, b); }
+    BH_TARGET_AVX512 static V mul(const V a, const V b) { return _mm512_mul_ps(a, b); }
+    BH_TARGET_AVX512 static V mul(const V src, const Mask lanes, const V a, const V b) { return _mm512_mask_mul_ps(src, lanes, a, b); }
+    BH_TARGET_AVX512 static V div(const V a, const V b) { return _mm512_div_ps(a, b); }
+    BH_TARGET_AVX512 static V div(const Mask lanes, const V a, const V b) { return _mm512_maskz_div_ps(lanes, a, b); }
+    BH_TARGET_AVX512 static V sqrt(const V a) { return _mm512_sqrt_ps(a); }
+    BH_TARGET_AVX512 static V fmadd(const V a, const V b, const V c) { return _mm512_fmadd_ps(a, b, c); }
+    BH_TARGET_AVX512 static V fmsub(const V a, const V b, const V c) { return _mm512_fmsub_ps(a, b, c); }
+    BH_TARGET_AVX512 static Mask greater(const V a, const V b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    BH_TARGET_AVX512 static Mask less(const V a, const V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    BH_TARGET_AVX512 static V blend(const Mask lanes, const V a, const V b) { return _mm512_mask_blend_ps(lanes, a, b); }
+
+    BH_TARGET_AVX512 static double sum(const V a)
+    {
+        // both halves are widened to double before the lanes are added up
+        const __m512d lo = _mm512_cvtps_pd(_mm512_castps512_ps256(a));
+        const __m512d hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a), 1)));
+        return _mm512_reduce_add_pd(_mm512_add_pd(lo, hi));
+    }
+
+    static Mask head(const std::size_t count)
+    {
+        return count >= width ? 0xffff : static_cast<Mask>((1u << count) - 1);
+    }
+};
+
+/**
+ * Vector counterpart of over_cube for AVX-512, zero in the lanes at zero distance.
+ */
+template <Softening S, typename Scalar>
+BH_TARGET_AVX512
+inline typename Avx512<Scalar>::V _over_cube_avx512(const typename Avx512<Scalar>::V m, const typename Avx512<Scalar>::V d2, const double length)
+{
+    using A = Avx512<Scalar>;
+    const auto nonzero = A::greater(d2, A::zero());
+    if constexpr (S == Softening::plummer)
+    {
+        const auto s2 = A::add(d2, A::set1(length * length));
+        return A::div(nonzero, m, A::mul(s2, A::sqrt(s2)));
+    }
+    const auto r = A::sqrt(d2);
+    auto f = A::div(nonzero, m, A::mul(d2, r));
+    if constexpr (S == Softening::spline)
+    {
+        // evaluate both pieces of the spline and blend them in below the support
+        const double h = spline_support * length;
+        const auto mh3 = A::mul(m, A::set1(1.0 / (h * h * h)));
+        const auto u = A::mul(r, A::set1(1.0 / h));
+        const auto u2 = A::mul(u, u);
+        const auto inner = A::fmadd(u2, A::fmsub(A::set1(32.0), u, A::set1(38.4)), A::set1(10.666666666667));
+        auto outer = A::fmadd(A::set1(-10.666666666667), u, A::set1(38.4));
+        outer = A::fmadd(outer, u, A::set1(-48.0));
+        outer = A::fmadd(outer, u, A::set1(21.333333333333));
+        outer = A::sub(outer, A::div(A::set1(0.066666666667), A::mul(u2, u)));
+        const auto piece = A::blend(A::less(u, A::set1(0.5)), outer, inner);
+        const auto inside = static_cast<typename A::Mask>(A::less(u, A::set1(1.0)) & nonzero);
+        f = A::mul(f, inside, mh3, piece);
+    }
+    return f;
+}
+
+/**
+ * Vector counterpart of Kernel::radial for AVX-512, zero in the lanes at zero distance.
+ */
+template <typename K, typename Scalar>
+BH_TARGET_AVX512
+inline typename Avx512<Scalar>::V _radial_avx512(const typename Avx512<Scalar>::V m, const typename Avx512<Scalar>::V d2, const double length)
+{
+    using A = Avx512<Scalar>;
+    if constexpr (K::law != ForceLaw::logarithmic)
+    {
+        return _over_cube_avx512<K::softening, Scalar>(m, d2, length);
+    }
+    else if constexpr (K::softening == Softening::spline)
+    {
+        return A::mul(A::sqrt(d2), _over_cube_avx512<Softening::spline, Scalar>(m, d2, length));
+    }
+    else
+    {
+        auto s2 = d2;
+        if constexpr (K::softening == Softening::plummer)
+        {
+            s2 = A::add(d2, A::set1(length * length));
+        }
+        return A::div(A::greater(d2, A::zero()), m, s2);
+    }
+}
+
+template <typename K, typename Scalar>
+BH_TARGET_AVX512
+inline void force_kernel_avx512(const Scalar *sx, const Scalar *sy, const Scalar *sm, const std::size_t n, const Scalar x, const Scalar y, const double length, const double coupling, double &ax, double &ay)
+{
+    using A = Avx512<Scalar>;
+    const auto vx = A::set1(x);
+    const auto vy = A::set1(y);
+    auto fx = A::zero();
+    auto fy = A::zero();
+
+    for (std::size_t i = 0; i < n; i += A::width)
+    {
+        // the masked-off lanes of the tail take the position of the target, at zero distance
+        const auto lanes = A::head(n - i);
+        auto dx = A::sub(A::load(lanes, sx + i, vx), vx);
+        auto dy = A::sub(A::load(lanes, sy + i, vy), vy);
+        auto pm = A::load(lanes, sm + i, A::zero());
+        auto d2 = A::fmadd(dx, dx, A::mul(dy, dy));
+        auto f = _radial_avx512<K, Scalar>(pm, d2, length);
+        fx = A::fmadd(f, dx, fx);
+        fy = A::fmadd(f, dy, fy);
+    }
+    ax += coupling * A::sum(fx);
+    ay += coupling * A::sum(fy);
+}
+
+#endif
+
+template <typename K, typename Scalar>
+inline ForceKernel<Scalar> select_force_kernel()
+{
+#ifdef BH_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return force_kernel_avx512<K, Scalar>;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return force_kernel_avx2<K, Scalar>;
+    }
+#endif
+    return force_kernel_scalar<K, Scalar>;
+}
+
+template <typename K, typename Scalar>
+inline const ForceKernel<Scalar> force_kernel = select_force_kernel<K, Scalar>();
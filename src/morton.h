@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "particle.h"
+
+constexpr int morton_bits = 21;  // bits per axis; a key uses the low 2 * morton_bits bits
+constexpr int radix_bits = 8;
+constexpr std::size_t radix_buckets = std::size_t {1} << radix_bits;
+
+/**
+ * Interleaves the low morton_bits bits of v with zeros, i.e. bit i moves to bit 2i.
+ */
+inline std::uint64_t spread_bits(std::uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 16) & 0x0000ffff0000ffff;
+    v = (v | v << 8) & 0x00ff00ff00ff00ff;
+    v = (v | v << 4) & 0x0f0f0f0f0f0f0f0f;
+    v = (v | v << 2) & 0x3333333333333333;
+    v = (v | v << 1) & 0x5555555555555555;
+    return v;
+}
+
+/**
+ * Computes the Z-order key of a point within the box [ll, ur]. Points outside the box are clamped
+ * onto its edges. The two bits at 2 * (morton_bits - 1 - level) select the quadrant at the given
+ * depth as (y << 1) | x.
+ */
+inline std::uint64_t morton_key(const double x, const double y, const std::array<double, 2> &ll, const std::array<double, 2> &ur)
+{
+    constexpr double cells = static_cast<double>(std::uint64_t {1} << morton_bits);
+    auto quantize = [&](const double v, const double lo, const double hi) -> std::uint64_t {
+        double scaled = (v - lo) / (hi - lo) * cells;
+        return static_cast<std::uint64_t>(std::clamp(scaled, 0.0, cells - 1.0));
+    };
+    return spread_bits(quantize(x, ll[0], ur[0])) | spread_bits(quantize(y, ll[1], ur[1])) << 1;
+}
+
+/**
+ * Particle indices sorted by Morton key. Sorting is an LSD radix sort whose histogram and scatter
+ * phases are split into blocks that can be executed concurrently; buffers are kept between steps.
+ */
+struct MortonOrder
+{
+    std::vector<std::uint64_t> keys;     // sorted keys
+    std::vector<std::uint32_t> indices;  // particle index of each sorted key
+
+    std::vector<std::uint64_t> _keys_scratch;
+    std::vector<std::uint32_t> _indices_scratch;
+    std::vector<std::array<std::size_t, radix_buckets>> _histograms;  // one per block
+
+    /**
+     * Computes the keys of every particle within [ll, ur] and sorts them.
+     *
+     * Arguments:
+     *     particles: particles to order
+     *     ll: lower left corner of the root
+     *     ur: upper right corner of the root
+     *     parallel: callable executing task(i) for every i in [0, count)
+     *     blocks: number of blocks to split each phase into
+     */
+    template <typename Scalar, typename Parallel>
+    void sort(const Particles<Scalar> &particles, const std::array<double, 2> &ll, const std::array<double, 2> &ur, Parallel &&parallel, std::size_t blocks)
+    {
+        const std::size_t n = particles.size();
+        blocks = std::max<std::size_t>(1, std::min(blocks, n));
+        keys.resize(n);
+        indices.resize(n);
+        _keys_scratch.resize(n);
+        _indices_scratch.resize(n);
+        _histograms.resize(blocks);
+
+        auto block_begin = [n, blocks](const std::size_t b) { return b * n / blocks; };
+
+        parallel(blocks, [&](const std::size_t b) {
+            for (auto i = block_begin(b); i < block_begin(b + 1); ++i)
+            {
+                keys[i] = morton_key(particles.x[i], particles.y[i], ll, ur);
+                indices[i] = static_cast<std::uint32_t>(i);
+            }
+        });
+
+        for (int shift = 0; shift < 2 * morton_bits; shift += radix_bits)
+        {
+            parallel(blocks, [&](const std::size_t b) {
+                auto &histogram = _histograms[b];
+                histogram.fill(0);
+                for (auto i = block_begin(b); i < block_begin(b + 1); ++i)
+                {
+                    ++histogram[(keys[i] >> shift) & (radix_buckets - 1)];
+                }
+            });
+
+            // exclusive prefix sum in (digit, block) order keeps the sort stable
+            std::size_t offset = 0;
+            bool trivial = false;
+            for (std::size_t digit = 0; digit < radix_buckets; ++digit)
+            {
+                std::size_t total = 0;
+                for (auto &histogram : _histograms)
+                {
+                    auto count = histogram[digit];
+                    histogram[digit] = offset + total;
+                    total += count;
+                }
+                trivial |= total == n;
+                offset += total;
+            }
+            if (trivial)
+            {
+                continue;  // every key shares this digit
+            }
+
+            parallel(blocks, [&](const std::size_t b) {
+                auto &histogram = _histograms[b];
+                for (auto i = block_begin(b); i < block_begin(b + 1); ++i)
+                {
+                    auto &slot = histogram[(keys[i] >> shift) & (radix_buckets - 1)];
+                    _keys_scratch[slot] = keys[i];
+                    _indices_scratch[slot] = indices[i];
+                    ++slot;
+                }
+            });
+            keys.swap(_keys_scratch);
+            indices.swap(_indices_scratch);
+        }
+    }
+};
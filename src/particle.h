@@ -1,48 +1,366 @@
 #pragma once
 
+#include <array>
 #include <cmath>
-#include <iostream>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
 
 constexpr double G = 6.67408e-11;
+constexpr double coulomb_constant = 8.9875517923e9;
 
-struct Particle
+enum class ForceLaw
 {
-    double x = 0.0;
-    double y = 0.0;
-    double vx = 0.0;
-    double vy = 0.0;
-    double ax = 0.0;
-    double ay = 0.0;
-    double m = 5.0e6;
+    newtonian,    // gravity of point masses, falling off as 1 / r^2
+    logarithmic,  // gravity in two dimensions, i.e. of parallel rods, falling off as 1 / r
+    coulomb       // electrostatics of signed charges, like charges repel; masses are inertia only
+};
 
-    void force(const Particle &o)
+enum class Softening
+{
+    none,     // exact point masses
+    plummer,  // point masses smeared into Plummer spheres of the softening length
+    spline    // cubic spline kernel, exact point masses beyond spline_support softening lengths
+};
+
+// support of the spline kernel in softening lengths, at which its potential at zero distance
+// matches that of a Plummer sphere of the same softening length
+constexpr double spline_support = 2.8;
+
+/**
+ * State of every particle in the system, one contiguous array per attribute. Particles are
+ * addressed by their index into the arrays. The scalar type is that of the whole simulation:
+ * double, or float for runs trading precision for half the memory traffic and twice the SIMD
+ * width.
+ */
+template <typename Scalar>
+struct Particles
+{
+    std::vector<Scalar> x;
+    std::vector<Scalar> y;
+    std::vector<Scalar> vx;
+    std::vector<Scalar> vy;
+    std::vector<Scalar> ax;
+    std::vector<Scalar> ay;
+    std::vector<Scalar> m;
+    std::vector<Scalar> q;  // charges, the sources of ForceLaw::coulomb
+
+    std::size_t size() const
+    {
+        return x.size();
+    }
+
+    bool empty() const
+    {
+        return x.empty();
+    }
+
+    void reserve(const std::size_t count)
+    {
+        for (auto *v : {&x, &y, &vx, &vy, &ax, &ay, &m, &q})
+        {
+            v->reserve(count);
+        }
+    }
+
+    void push_back(const Scalar px, const Scalar py, const Scalar pvx = 0.0, const Scalar pvy = 0.0, const Scalar pax = 0.0, const Scalar pay = 0.0, const Scalar pm = 5.0e6, const Scalar pq = 0.0)
+    {
+        x.push_back(px);
+        y.push_back(py);
+        vx.push_back(pvx);
+        vy.push_back(pvy);
+        ax.push_back(pax);
+        ay.push_back(pay);
+        m.push_back(pm);
+        q.push_back(pq);
+    }
+
+    /**
+     * Replaces every particle with those of another set, converted to this scalar type.
+     */
+    template <typename Other>
+    void assign(const Particles<Other> &other)
     {
-        double dx = o.x - x;
-        double dy = o.y - y;
-        force(dx, dy, o.m);
+        x.assign(other.x.begin(), other.x.end());
+        y.assign(other.y.begin(), other.y.end());
+        vx.assign(other.vx.begin(), other.vx.end());
+        vy.assign(other.vy.begin(), other.vy.end());
+        ax.assign(other.ax.begin(), other.ax.end());
+        ay.assign(other.ay.begin(), other.ay.end());
+        m.assign(other.m.begin(), other.m.end());
+        q.assign(other.q.begin(), other.q.end());
     }
+};
 
-    void force(const double dx, const double dy, const double omass)
+/**
+ * Softened counterpart of m / r^3, i.e. the field per unit offset of a source at squared distance
+ * d2 under an inverse square law.
+ *
+ * Arguments:
+ *     m: strength of the source, or any factor of the field
+ *     d2: squared distance to the source
+ *     length: softening length
+ */
+template <Softening S>
+inline double over_cube(const double m, const double d2, const double length)
+{
+    if constexpr (S == Softening::plummer)
+    {
+        double s2 = d2 + length * length;
+        return m / (s2 * std::sqrt(s2));
+    }
+    else if constexpr (S == Softening::spline)
     {
-        double d = std::hypot(dx, dy);
-        double t = std::atan2(dy, dx);
-        double f = G * omass / (d * d);
-        ax += f * std::cos(t);
-        ay += f * std::sin(t);
+        const double h = spline_support * length;
+        if (d2 < h * h)
+        {
+            // force of the cubic spline kernel as used by GADGET-2
+            const double mh3 = m / (h * h * h);
+            const double u = std::sqrt(d2) / h;
+            if (u < 0.5)
+            {
+                return mh3 * (10.666666666667 + u * u * (32.0 * u - 38.4));
+            }
+            return mh3 * (21.333333333333 - 48.0 * u + 38.4 * u * u - 10.666666666667 * u * u * u - 0.066666666667 / (u * u * u));
+        }
     }
+    return m / (d2 * std::sqrt(d2));
+}
 
-    void integrate(const double dt)
+/**
+ * Softened counterpart of m / r^2, the field per unit offset under the logarithmic potential. The
+ * spline smooths it by the same fraction of the source within r as it does the inverse square law.
+ *
+ * Arguments:
+ *     m: strength of the source, or any factor of the field
+ *     d2: squared distance to the source
+ *     length: softening length
+ */
+template <Softening S>
+inline double over_square(const double m, const double d2, const double length)
+{
+    if constexpr (S == Softening::plummer)
+    {
+        return m / (d2 + length * length);
+    }
+    else if constexpr (S == Softening::spline)
     {
-        vx += ax * dt;
-        vy += ay * dt;
-        x += vx * dt;
-        y += vy * dt;
-        ax = 0.0;
-        ay = 0.0;
+        if (d2 < spline_support * spline_support * length * length)
+        {
+            return std::sqrt(d2) * over_cube<S>(m, d2, length);
+        }
     }
+    return m / d2;
+}
 
-    void print()
+/**
+ * Interaction between particles, fixed at compile time: the force law and its softening. Tree walks
+ * and force kernels are instantiated per kernel, so their inner loops carry no trace of the others.
+ * Interactions are evaluated in double precision whatever the scalar type of the particles, except
+ * in the vectorized force kernels.
+ */
+template <ForceLaw L, Softening S>
+struct Kernel
+{
+    static constexpr ForceLaw law = L;
+    static constexpr Softening softening = S;
+
+    /**
+     * Field per unit offset of a source at squared distance d2.
+     *
+     * Arguments:
+     *     m: strength of the source, or any factor of the field
+     *     d2: squared distance to the source
+     *     length: softening length
+     */
+    static double radial(const double m, const double d2, const double length)
+    {
+        if constexpr (L == ForceLaw::logarithmic)
+        {
+            return over_square<S>(m, d2, length);
+        }
+        return over_cube<S>(m, d2, length);
+    }
+
+    /**
+     * Strength of a particle as a source: its charge under Coulomb's law, its mass otherwise.
+     */
+    template <typename Scalar>
+    static double strength(const Particles<Scalar> &particles, const std::uint32_t e)
+    {
+        if constexpr (L == ForceLaw::coulomb)
+        {
+            return particles.q[e];
+        }
+        return particles.m[e];
+    }
+
+    /**
+     * Factor turning the field at a particle into its acceleration: G for gravity, -k q / m for a
+     * charge, as like charges push apart.
+     */
+    template <typename Scalar>
+    static double coupling(const Particles<Scalar> &particles, const std::uint32_t e)
+    {
+        if constexpr (L == ForceLaw::coulomb)
+        {
+            return -coulomb_constant * particles.q[e] / particles.m[e];
+        }
+        return G;
+    }
+};
+
+/**
+ * Calls body with the Kernel for a force law and softening chosen at run time, so everything it
+ * calls is specialized for them at compile time.
+ *
+ * Arguments:
+ *     law: force law
+ *     softening: softening of the law
+ *     body: generic callable taking a Kernel
+ */
+template <typename Body>
+inline decltype(auto) dispatch_kernel(const ForceLaw law, const Softening softening, Body &&body)
+{
+    auto soften = [&](auto l) -> decltype(auto) {
+        switch (softening)
+        {
+        case Softening::plummer:
+            return body(Kernel<decltype(l)::value, Softening::plummer> {});
+        case Softening::spline:
+            return body(Kernel<decltype(l)::value, Softening::spline> {});
+        default:
+            return body(Kernel<decltype(l)::value, Softening::none> {});
+        }
+    };
+    switch (law)
+    {
+    case ForceLaw::logarithmic:
+        return soften(std::integral_constant<ForceLaw, ForceLaw::logarithmic> {});
+    case ForceLaw::coulomb:
+        return soften(std::integral_constant<ForceLaw, ForceLaw::coulomb> {});
+    default:
+        return soften(std::integral_constant<ForceLaw, ForceLaw::newtonian> {});
+    }
+}
+
+/**
+ * Adds the acceleration caused by a point source.
+ *
+ * Arguments:
+ *     dx: x offset from the particle to the source
+ *     dy: y offset from the particle to the source
+ *     omass: strength of the source
+ *     length: softening length
+ *     coupling: Kernel::coupling of the particle
+ *     ax: x acceleration to add to
+ *     ay: y acceleration to add to
+ */
+template <typename K>
+inline void point_force(const double dx, const double dy, const double omass, const double length, const double coupling, double &ax, double &ay)
+{
+    double f = K::radial(coupling * omass, dx * dx + dy * dy, length);
+    ax += f * dx;
+    ay += f * dy;
+}
+
+/**
+ * Squared distance at which the multipole terms of a cell are evaluated: the Plummer potential
+ * depends on the distance only through r^2 + length^2, so its expansion is the same with that in
+ * place of r^2. Cells within the support of the spline kernel act through their softened monopole
+ * alone, marked by a return value of zero.
+ */
+template <Softening S>
+inline double _multipole_d2(const double d2, const double length)
+{
+    if constexpr (S == Softening::plummer)
+    {
+        return d2 + length * length;
+    }
+    else if constexpr (S == Softening::spline)
+    {
+        if (d2 < spline_support * spline_support * length * length)
+        {
+            return 0.0;
+        }
+    }
+    return d2;
+}
+
+/**
+ * Adds the field of the first moments of a distant cell, the dipole term of the expansion of its
+ * potential about its center. Vanishes for masses expanded about their center of gravity, so only
+ * charges need it.
+ *
+ * Arguments:
+ *     dx: x offset from the particle to the center of the cell
+ *     dy: y offset from the particle to the center of the cell
+ *     p: first moments x, y of the cell's sources about its center
+ *     length: softening length
+ *     coupling: Kernel::coupling of the particle
+ *     ax: x acceleration to add to
+ *     ay: y acceleration to add to
+ */
+template <typename K, typename Scalar>
+inline void dipole_force(const double dx, const double dy, const std::array<Scalar, 2> &p, const double length, const double coupling, double &ax, double &ay)
+{
+    double d2 = _multipole_d2<K::softening>(dx * dx + dy * dy, length);
+    if (d2 == 0.0)
+    {
+        return;
+    }
+    double dp = dx * p[0] + dy * p[1];
+    if constexpr (K::law == ForceLaw::logarithmic)
+    {
+        double inv_d2 = 1.0 / d2;
+        ax += coupling * inv_d2 * (p[0] - 2.0 * dx * dp * inv_d2);
+        ay += coupling * inv_d2 * (p[1] - 2.0 * dy * dp * inv_d2);
+    }
+    else
+    {
+        double inv_d3 = 1.0 / (d2 * std::sqrt(d2));
+        ax += coupling * inv_d3 * (p[0] - 3.0 * dx * dp / d2);
+        ay += coupling * inv_d3 * (p[1] - 3.0 * dy * dp / d2);
+    }
+}
+
+/**
+ * Adds the field of the second moments of a distant cell, i.e. the quadrupole term of the
+ * expansion of its potential about its center.
+ *
+ * Arguments:
+ *     dx: x offset from the particle to the center of the cell
+ *     dy: y offset from the particle to the center of the cell
+ *     s: second moments xx, xy, yy of the cell's sources about its center
+ *     length: softening length
+ *     coupling: Kernel::coupling of the particle
+ *     ax: x acceleration to add to
+ *     ay: y acceleration to add to
+ */
+template <typename K, typename Scalar>
+inline void quadrupole_force(const double dx, const double dy, const std::array<Scalar, 3> &s, const double length, const double coupling, double &ax, double &ay)
+{
+    double d2 = _multipole_d2<K::softening>(dx * dx + dy * dy, length);
+    if (d2 == 0.0)
+    {
+        return;
+    }
+    double sdx = s[0] * dx + s[1] * dy;
+    double sdy = s[1] * dx + s[2] * dy;
+    double dsd = dx * sdx + dy * sdy;
+    if constexpr (K::law == ForceLaw::logarithmic)
+    {
+        double inv_d4 = 1.0 / (d2 * d2);
+        double radial = 4.0 * dsd / d2 - (s[0] + s[2]);
+        ax += coupling * inv_d4 * (radial * dx - 2.0 * sdx);
+        ay += coupling * inv_d4 * (radial * dy - 2.0 * sdy);
+    }
+    else
     {
-        std::cout << "<" << x << "," << y << ">" << std::endl;
+        double inv_d5 = 1.0 / (d2 * d2 * std::sqrt(d2));
+        double radial = 7.5 * dsd / d2 - 1.5 * (s[0] + s[2]);
+        ax += coupling * inv_d5 * (radial * dx - 3.0 * sdx);
+        ay += coupling * inv_d5 * (radial * dy - 3.0 * sdy);
     }
-};
\ No newline at end of file
+}
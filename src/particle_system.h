@@ -1,18 +1,131 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
 #include <random>
 #include <vector>
 
+#include "fmm.h"
 #include "particle.h"
 #include "quadtree.h"
+#include "triple_buffer.h"
 
 
+enum class TreeBuilder
+{
+    insertion,  // insert particles one at a time from the root
+    morton      // sort particles by Morton key in parallel, then lay out the hierarchy
+};
+
+enum class Solver
+{
+    barnes_hut,     // walk the quadtree once per particle
+    fast_multipole  // dual-tree traversal with multipole and local expansions
+};
+
+enum class Integrator
+{
+    euler,     // semi-implicit Euler, one force evaluation per step
+    leapfrog,  // kick-drift-kick leapfrog, second order, one force evaluation per step
+    yoshida    // three leapfrog substeps composed to fourth order, three force evaluations per step
+};
+
+/**
+ * Copy of the state at the end of a step, handed from the integrator to readers.
+ */
+template <typename Scalar>
+struct Frame
+{
+    std::vector<Scalar> positions;               // x and y of every particle, interleaved
+    std::vector<Scalar> masses;
+    std::vector<std::array<double, 4>> extents;  // occupied quadtree leaves, if published
+};
+
+/**
+ * Bounding box and first two moments of a set of positions, reduced per block of particles and
+ * merged afterwards.
+ */
+struct Extent
+{
+    std::array<double, 2> lo {std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity()};
+    std::array<double, 2> hi {-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity()};
+    std::array<double, 2> sum {0.0, 0.0};
+    std::array<double, 2> sum_sq {0.0, 0.0};
+    std::size_t count {0};
+
+    void add(const double x, const double y)
+    {
+        lo = {std::min(lo[0], x), std::min(lo[1], y)};
+        hi = {std::max(hi[0], x), std::max(hi[1], y)};
+        sum = {sum[0] + x, sum[1] + y};
+        sum_sq = {sum_sq[0] + x * x, sum_sq[1] + y * y};
+        ++count;
+    }
+
+    void merge(const Extent &o)
+    {
+        lo = {std::min(lo[0], o.lo[0]), std::min(lo[1], o.lo[1])};
+        hi = {std::max(hi[0], o.hi[0]), std::max(hi[1], o.hi[1])};
+        sum = {sum[0] + o.sum[0], sum[1] + o.sum[1]};
+        sum_sq = {sum_sq[0] + o.sum_sq[0], sum_sq[1] + o.sum_sq[1]};
+        count += o.count;
+    }
+};
+
+/**
+ * Particles and the machinery advancing them, in a given scalar type: double, or float for runs
+ * where visual accuracy suffices. Particles and the flattened tree are stored in the scalar type,
+ * while tree moments, multipole expansions and the interactions summed per particle are kept in
+ * double precision.
+ */
+template <typename Scalar>
 struct ParticleSystem {
+    using Task = std::function<void(std::size_t)>;
+
     std::array<double, 2> ll {-1, -1};
     std::array<double, 2> ur {1, 1};
-    QuadTree qt;
+    QuadTree<Scalar> qt;
     double theta;
+    std::size_t bucket_size = 1;  // maximum number of particles per quadtree leaf
+    std::size_t max_depth = 32;   // quadtree depth at which leaves stop splitting, at most 64
+    TreeBuilder tree_builder = TreeBuilder::insertion;
+    MultipoleOrder multipole_order = MultipoleOrder::monopole;
+    Solver solver = Solver::barnes_hut;
+    ForceLaw force_law = ForceLaw::newtonian;  // other laws are solved by tree walks, also with Solver::fast_multipole
+    Softening softening = Softening::none;
+    double softening_length = 0.0;  // scale below which close encounters are smoothed out
+    Integrator integrator = Integrator::euler;
+    bool _forces_current = false;  // whether ax, ay hold the accelerations at the current positions; clear after changing theta or the force settings
+    std::size_t timestep_levels = 0;     // halvings of the step open to leapfrog particles, at most 16; 0 steps all alike
+    double timestep_displacement = 0.01;  // largest displacement by a particle's acceleration over its step
+    std::vector<std::uint8_t> levels;     // per particle, halvings of the step it currently takes
+    std::vector<std::uint32_t> active;    // particles whose substep ends at the current tick
+    int expansion_order = 4;  // highest order of the fast multipole expansions
+    std::size_t group_size = 0;  // bodies sharing one tree walk; 0 walks the tree per particle
+    std::vector<std::uint32_t> costs;  // interactions of each particle in the last walk
+    std::vector<std::size_t> splits;   // bounds of the cost-balanced ranges of bodies
+    double escape_sigmas = 0.0;  // standard deviations from the mean beyond which particles leave the tree; 0 keeps all
+    std::vector<std::uint32_t> escapers;  // particles kept out of the tree, interacting directly
+    std::vector<std::uint8_t> _escaped;   // per particle, whether it is in ParticleSystem::escapers
+    Sources<Scalar> _escaper_sources;
+    std::vector<Extent> _extents;  // per block of ParticleSystem::_kick_drift
+    FastMultipole<Scalar> fmm;
+    TripleBuffer<Frame<Scalar>> frames;  // latest published state for readers on other threads
+    bool publish_extents = true;  // whether frames include the quadtree extents
+
+    // executes task(i) for every i in [0, count) and returns once all have completed; systems
+    // owning a thread pool replace it, along with the number of tasks they run at once
+    std::function<void(std::size_t, const Task &)> parallel = [](const std::size_t count, const Task &task) {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            task(i);
+        }
+    };
+    std::size_t concurrency = 1;
 
     ParticleSystem(const int num_particles, const double bounds, const double default_theta, const int seed=1337):
         ll {-bounds, -bounds},
@@ -23,45 +136,632 @@ struct ParticleSystem {
         std::uniform_real_distribution<double> dis(-bounds, bounds);
         particles.reserve(num_particles);
         for (auto i = 0; i < num_particles-1; ++i) {
-            auto &p = particles.emplace_back(dis(eng), dis(eng));
+            particles.push_back(dis(eng), dis(eng));
         }
-        particles.emplace_back(0, 0, 0, 0, 0, 0, 1e12);
+        particles.push_back(0, 0, 0, 0, 0, 0, 1e12);
+        publish();
+    }
+
+    /**
+     * Takes over the particles and settings of a system of any scalar type, converting the
+     * particles to this one, e.g. to rerun its state at another precision.
+     *
+     * Arguments:
+     *     other: system to copy
+     */
+    template <typename Other>
+    void assign(const ParticleSystem<Other> &other)
+    {
+        ll = other.ll;
+        ur = other.ur;
+        theta = other.theta;
+        bucket_size = other.bucket_size;
+        max_depth = other.max_depth;
+        tree_builder = other.tree_builder;
+        multipole_order = other.multipole_order;
+        solver = other.solver;
+        force_law = other.force_law;
+        softening = other.softening;
+        softening_length = other.softening_length;
+        integrator = other.integrator;
+        timestep_levels = other.timestep_levels;
+        timestep_displacement = other.timestep_displacement;
+        expansion_order = other.expansion_order;
+        group_size = other.group_size;
+        escape_sigmas = other.escape_sigmas;
+        publish_extents = other.publish_extents;
+        particles.assign(other.particles);
+        _forces_current = other._forces_current;
+        escapers = other.escapers;
+        _escaped = other._escaped;
+        costs.clear();
+    }
+
+    /**
+     * Whether forces come from the fast multipole method, whose expansions are those of Newtonian
+     * gravity.
+     */
+    bool _multipole() const
+    {
+        return solver == Solver::fast_multipole && force_law == ForceLaw::newtonian;
     }
 
     void build_tree()
     {
-        qt = {.theta=theta, .ll=ll, .ur=ur};
-        for (auto &e : particles)
+        qt.reset(particles, theta, bucket_size, max_depth, ll, ur);
+        qt.law = force_law;
+        qt.softening = softening;
+        qt.softening_length = softening_length;
+        auto in_tree = [this](const std::uint32_t i) {
+            return escapers.empty() || !_escaped[i];
+        };
+        if (tree_builder == TreeBuilder::morton)
+        {
+            qt.build_morton(parallel, concurrency, in_tree);
+        }
+        else
+        {
+            for (std::uint32_t i = 0; i < particles.size(); ++i)
+            {
+                if (in_tree(i))
+                {
+                    qt.add(i);
+                }
+            }
+        }
+        qt.get_cogs(parallel, concurrency);
+        if (!_multipole() || !escapers.empty() || _block_steps())
+        {
+            // escapers and block substeps walk the flattened tree whatever the solver
+            qt.compile();
+        }
+        if (!_multipole())
+        {
+            qt.find_groups(group_size);
+        }
+    }
+
+    /**
+     * Refreshes the tree for the positions reached since ParticleSystem::build_tree, keeping its
+     * topology and the set of escapers.
+     */
+    void refit_tree()
+    {
+        qt.refit(parallel, concurrency);
+        _gather_escapers();
+    }
+
+    /**
+     * Splits the bodies of the flattened tree into consecutive ranges of about equal cost, going
+     * by the interactions each particle took in the previous walk. Bodies are in depth-first
+     * order, so every range is a spatially coherent run of particles along the Morton curve.
+     *
+     * Arguments:
+     *     ranges: number of ranges to split into
+     */
+    void balance(const std::size_t ranges)
+    {
+        const auto &order = qt.bodies.particle;
+        costs.resize(particles.size(), 1);
+        std::uint64_t total = 0;
+        for (auto e : order)
+        {
+            total += costs[e];
+        }
+
+        splits.assign(1, 0);
+        std::uint64_t cost = 0;
+        for (std::size_t b = 0; b < order.size(); ++b)
         {
-            qt.add(e);
+            cost += costs[order[b]];
+            // range k ends once the running cost reaches k / ranges of the total
+            if (cost * ranges >= total * splits.size() && splits.size() < ranges)
+            {
+                splits.push_back(b + 1);
+            }
+        }
+        if (splits.back() != order.size())
+        {
+            splits.push_back(order.size());
         }
-        qt.get_cogs();
     }
 
+    /**
+     * Walks the tree for a range of bodies of the flattened tree and records the cost of each.
+     *
+     * Arguments:
+     *     start: first body
+     *     count: number of bodies
+     */
     void collect_forces(std::size_t start, std::size_t count)
     {
+        for (auto b = start; b < start + count; ++b) {
+            const auto e = qt.bodies.particle[b];
+            costs[e] = qt.force(e, multipole_order);
+        }
+    }
+
+    /**
+     * Walks the tree for a range of ParticleSystem::active and adds the escapers by direct
+     * summation.
+     *
+     * Arguments:
+     *     start: first index into ParticleSystem::active
+     *     count: number of particles
+     */
+    void collect_active_forces(std::size_t start, std::size_t count)
+    {
+        dispatch_kernel(force_law, softening, [&](auto kernel) {
+            using K = decltype(kernel);
+            for (auto k = start; k < start + count; ++k) {
+                const auto e = active[k];
+                costs[e] = qt.force(e, multipole_order);
+                if (!escapers.empty())
+                {
+                    _escaper_force<K>(e);
+                }
+            }
+        });
+    }
+
+    void collect_group_forces(std::size_t start, std::size_t count)
+    {
+        thread_local InteractionList<Scalar> list;
         for (auto i = start; i < start + count; ++i) {
-            qt.force(particles[i]);
+            qt.group_force(i, list, multipole_order);
         }
     }
 
-    void integrate(const double delta_time) {
-        double bounds = 0.0;
-        for (auto &e : particles)
+    void collect_multipole_forces()
+    {
+        fmm.evaluate(qt, expansion_order, theta, parallel);
+    }
+
+    /**
+     * Adds the interactions involving particles kept out of the tree: every particle feels the
+     * escapers by direct summation, and escapers feel the tree through a walk of their own. Must
+     * follow the solver in every step with escapers.
+     */
+    void collect_escaper_forces()
+    {
+        _gather_escapers();
+
+        const auto n = particles.size();
+        const auto blocks = std::max<std::size_t>(1, std::min(4 * concurrency, n));
+        dispatch_kernel(force_law, softening, [&](auto kernel) {
+            using K = decltype(kernel);
+            parallel(blocks, [this, n, blocks](const std::size_t b) {
+                for (auto i = b * n / blocks; i < (b + 1) * n / blocks; ++i)
+                {
+                    _escaper_force<K>(static_cast<std::uint32_t>(i));
+                }
+            });
+        });
+        parallel(escapers.size(), [this](const std::size_t k) {
+            qt.force(escapers[k], multipole_order);
+        });
+    }
+
+    /**
+     * Adds the acceleration of a particle caused by the escapers, summed directly.
+     *
+     * Arguments:
+     *     e: index of the particle
+     */
+    template <typename K>
+    void _escaper_force(const std::uint32_t e)
+    {
+        const auto &sources = _escaper_sources;
+        double ax = particles.ax[e];
+        double ay = particles.ay[e];
+        force_kernel<K, Scalar>(sources.x.data(), sources.y.data(), sources.m.data(), sources.x.size(), particles.x[e], particles.y[e], softening_length, K::coupling(particles, e), ax, ay);
+        particles.ax[e] = static_cast<Scalar>(ax);
+        particles.ay[e] = static_cast<Scalar>(ay);
+    }
+
+    void _gather_escapers()
+    {
+        _escaper_sources.clear();
+        for (auto e : escapers)
         {
-            e.integrate(delta_time);
+            _escaper_sources.push_back(particles.x[e], particles.y[e], force_law == ForceLaw::coulomb ? particles.q[e] : particles.m[e]);
+        }
+    }
 
-            if (std::abs(e.x) > bounds)
+    /**
+     * Advances the system by one time step with the selected integrator. Forces are evaluated by
+     * the given callables, which add the accelerations at the current positions to ax, ay after
+     * they have been zeroed; the leapfrog integrators keep their last result for the first kick of
+     * the next step.
+     *
+     * Arguments:
+     *     delta_time: time step
+     *     accelerate: function evaluating the forces on every particle, including building the tree
+     *     accelerate_active: function evaluating the forces on ParticleSystem::active only, on
+     *                        the tree refreshed by ParticleSystem::refit_tree
+     *     publish_frame: whether to publish the new state to ParticleSystem::frames
+     */
+    template <typename Accelerate, typename AccelerateActive>
+    void advance(const double delta_time, Accelerate &&accelerate, AccelerateActive &&accelerate_active, const bool publish_frame = true)
+    {
+        if (integrator == Integrator::euler)
+        {
+            // forces kept by a previous leapfrog step would otherwise be added to
+            if (_forces_current)
             {
-                bounds = std::abs(e.x);
+                std::fill(particles.ax.begin(), particles.ax.end(), 0.0);
+                std::fill(particles.ay.begin(), particles.ay.end(), 0.0);
             }
-            if (std::abs(e.y) > bounds)
+            accelerate();
+            _kick_drift([delta_time](std::size_t) { return delta_time; }, delta_time);
+            _forces_current = false;
+        }
+        else
+        {
+            if (!_forces_current)
+            {
+                std::fill(particles.ax.begin(), particles.ax.end(), 0.0);
+                std::fill(particles.ay.begin(), particles.ay.end(), 0.0);
+                accelerate();
+                _forces_current = true;
+            }
+            if (_block_steps())
+            {
+                _block_leapfrog(delta_time, accelerate, accelerate_active);
+            }
+            else if (integrator == Integrator::leapfrog)
+            {
+                _leapfrog(delta_time, accelerate);
+            }
+            else
             {
-                bounds = std::abs(e.y);
+                // Yoshida's triple jump: the middle substep runs backwards in time so the third
+                // order errors of the outer two cancel
+                const double w1 = 1.0 / (2.0 - std::cbrt(2.0));
+                const double w0 = 1.0 - 2.0 * w1;
+                for (const double w : {w1, w0, w1})
+                {
+                    _leapfrog(w * delta_time, accelerate);
+                }
             }
         }
-        ll = {-bounds, -bounds};
-        ur = {bounds, bounds};
+        if (publish_frame)
+        {
+            publish();
+        }
+    }
+
+    /**
+     * Kick-drift-kick leapfrog substep, starting from the accelerations at the current positions
+     * and ending with those at the new positions.
+     *
+     * Arguments:
+     *     delta_time: length of the substep
+     *     accelerate: function evaluating the forces
+     */
+    template <typename Accelerate>
+    void _leapfrog(const double delta_time, Accelerate &accelerate)
+    {
+        _kick_drift([delta_time](std::size_t) { return 0.5 * delta_time; }, delta_time);
+        accelerate();
+        _kick(0.5 * delta_time);
+    }
+
+    bool _block_steps() const
+    {
+        return integrator == Integrator::leapfrog && timestep_levels > 0;
+    }
+
+    /**
+     * Kick-drift-kick leapfrog step with a power-of-two fraction of the step per particle. The
+     * step is cut into ticks of the shortest fraction; every particle drifts each tick, but only
+     * those whose own substep ends at a tick are kicked, and only their forces are evaluated,
+     * mostly on a refitted tree. The step ends with every particle in sync and a full force
+     * evaluation.
+     *
+     * Arguments:
+     *     delta_time: time step
+     *     accelerate: function evaluating the forces on every particle
+     *     accelerate_active: function evaluating the forces on ParticleSystem::active
+     */
+    template <typename Accelerate, typename AccelerateActive>
+    void _block_leapfrog(const double delta_time, Accelerate &accelerate, AccelerateActive &accelerate_active)
+    {
+        const auto n = particles.size();
+        const auto depth = std::min<std::size_t>(timestep_levels, 16);
+        const std::size_t ticks = std::size_t {1} << depth;
+        const double tick_time = delta_time / static_cast<double>(ticks);
+        auto span = [this, depth](const std::size_t i) {
+            return std::size_t {1} << (depth - levels[i]);
+        };
+
+        // the tree of the last full evaluation is only flattened when it was built for block steps
+        if (!qt.flat_current)
+        {
+            qt.compile();
+        }
+
+        // every particle is in sync at the start of a step, free to take any level
+        levels.resize(n);
+        costs.resize(n, 1);
+        _relevel(0, depth, delta_time);
+        std::size_t walked = 0;
+        for (std::size_t tick = 0; tick < ticks; ++tick)
+        {
+            const auto end = tick + 1;
+            active.clear();
+            if (end < ticks)
+            {
+                for (auto e : qt.bodies.particle)
+                {
+                    if (end % span(e) == 0)
+                    {
+                        active.push_back(e);
+                    }
+                }
+                for (auto e : escapers)
+                {
+                    if (end % span(e) == 0)
+                    {
+                        active.push_back(e);
+                    }
+                }
+            }
+            // walks slow down as particles drift out of the cells of a refitted tree, so it is
+            // rebuilt once it has served a quarter as many walks as there are particles
+            walked += active.size();
+            const bool rebuild = end == ticks || 4 * walked >= n;
+            _kick_drift([&](const std::size_t i) { return tick % span(i) == 0 ? 0.5 * tick_time * span(i) : 0.0; }, tick_time, rebuild);
+            if (end == ticks)
+            {
+                accelerate();
+            }
+            else if (rebuild)
+            {
+                walked = 0;
+                build_tree();
+                _gather_escapers();
+                accelerate_active();
+            }
+            else
+            {
+                refit_tree();
+                accelerate_active();
+            }
+
+            const auto blocks = std::max<std::size_t>(1, std::min(4 * concurrency, n));
+            parallel(blocks, [&](const std::size_t b) {
+                for (auto i = b * n / blocks; i < (b + 1) * n / blocks; ++i)
+                {
+                    if (end % span(i) == 0)
+                    {
+                        particles.vx[i] += particles.ax[i] * 0.5 * tick_time * span(i);
+                        particles.vy[i] += particles.ay[i] * 0.5 * tick_time * span(i);
+                    }
+                }
+            });
+            if (end < ticks)
+            {
+                _relevel(end, depth, delta_time);
+            }
+        }
+    }
+
+    /**
+     * Picks the level of the particles whose substep ends at a tick from their acceleration. A
+     * particle moves to a longer substep only where the longer one starts, so substeps of every
+     * length stay aligned to the step.
+     *
+     * Arguments:
+     *     tick: tick the substeps end at
+     *     depth: highest level
+     *     delta_time: time step
+     */
+    void _relevel(const std::size_t tick, const std::size_t depth, const double delta_time)
+    {
+        const auto n = particles.size();
+        const auto blocks = std::max<std::size_t>(1, std::min(4 * concurrency, n));
+        parallel(blocks, [&](const std::size_t b) {
+            for (auto i = b * n / blocks; i < (b + 1) * n / blocks; ++i)
+            {
+                if (tick % (std::size_t {1} << (depth - std::min<std::size_t>(levels[i], depth))) != 0)
+                {
+                    continue;
+                }
+                // a step of sqrt(2 s / a) displaces a particle by s under its acceleration
+                const double a = std::hypot(particles.ax[i], particles.ay[i]);
+                std::size_t level = 0;
+                if (a > 0.0)
+                {
+                    const double ratio = delta_time / std::sqrt(2.0 * timestep_displacement / a);
+                    level = ratio > 1.0 ? std::min<std::size_t>(depth, static_cast<std::size_t>(std::ceil(std::log2(ratio)))) : 0;
+                }
+                while (tick % (std::size_t {1} << (depth - level)) != 0)
+                {
+                    ++level;
+                }
+                levels[i] = static_cast<std::uint8_t>(level);
+            }
+        });
+    }
+
+    /**
+     * Advances velocities by the current accelerations.
+     *
+     * Arguments:
+     *     delta_time: time over which the accelerations act
+     */
+    void _kick(const double delta_time)
+    {
+        const auto n = particles.size();
+        const auto blocks = std::max<std::size_t>(1, std::min(4 * concurrency, n));
+        parallel(blocks, [this, n, blocks, delta_time](const std::size_t b) {
+            auto *vx = particles.vx.data();
+            auto *vy = particles.vy.data();
+            auto *ax = particles.ax.data();
+            auto *ay = particles.ay.data();
+            for (auto i = b * n / blocks; i < (b + 1) * n / blocks; ++i)
+            {
+                vx[i] += ax[i] * delta_time;
+                vy[i] += ay[i] * delta_time;
+            }
+        });
+    }
+
+    /**
+     * Advances velocities by the current accelerations, then positions by the new velocities,
+     * clearing the accelerations for the next force evaluation. The bounding box of the new
+     * positions is found in the same pass: blocks of particles are handed to the parallel
+     * callable, each reducing its own box, and the boxes are merged afterwards to place the root.
+     *
+     * Arguments:
+     *     kick_time: callable returning the time over which the accelerations of a particle act
+     *     drift_time: time over which the velocities act
+     *     place_root: whether to pick the escapers and the root for the next tree build
+     */
+    template <typename KickTime>
+    void _kick_drift(KickTime &&kick_time, const double drift_time, const bool place_root = true)
+    {
+        const auto n = particles.size();
+        const auto blocks = std::max<std::size_t>(1, std::min(4 * concurrency, n));
+        _extents.resize(blocks);
+
+        parallel(blocks, [this, n, blocks, &kick_time, drift_time](const std::size_t b) {
+            auto *x = particles.x.data();
+            auto *y = particles.y.data();
+            auto *vx = particles.vx.data();
+            auto *vy = particles.vy.data();
+            auto *ax = particles.ax.data();
+            auto *ay = particles.ay.data();
+            Extent extent;
+            for (auto i = b * n / blocks; i < (b + 1) * n / blocks; ++i)
+            {
+                const double kick = kick_time(i);
+                vx[i] += ax[i] * kick;
+                vy[i] += ay[i] * kick;
+                x[i] += vx[i] * drift_time;
+                y[i] += vy[i] * drift_time;
+                ax[i] = 0.0;
+                ay[i] = 0.0;
+
+                extent.add(x[i], y[i]);
+            }
+            _extents[b] = extent;
+        });
+
+        if (!place_root)
+        {
+            return;
+        }
+        Extent total;
+        for (const auto &extent : _extents)
+        {
+            total.merge(extent);
+        }
+        escapers.clear();
+        if (escape_sigmas > 0.0 && n > 1)
+        {
+            total = _exclude_escapers(total, blocks);
+        }
+        _set_root(total);
+    }
+
+    /**
+     * Flags the particles farther from the mean position than escape_sigmas standard deviations
+     * along either axis and collects them into ParticleSystem::escapers.
+     *
+     * Arguments:
+     *     all: extent of every particle
+     *     blocks: number of blocks to split the pass into
+     *
+     * Returns:
+     *     extent of the particles that remain in the tree
+     */
+    Extent _exclude_escapers(const Extent &all, const std::size_t blocks)
+    {
+        const auto n = particles.size();
+        std::array<double, 2> mean;
+        std::array<double, 2> limit;
+        for (int k = 0; k < 2; ++k)
+        {
+            mean[k] = all.sum[k] / n;
+            limit[k] = escape_sigmas * std::sqrt(std::max(0.0, all.sum_sq[k] / n - mean[k] * mean[k]));
+        }
+
+        _escaped.resize(n);
+        parallel(blocks, [this, n, blocks, mean, limit](const std::size_t b) {
+            Extent extent;
+            for (auto i = b * n / blocks; i < (b + 1) * n / blocks; ++i)
+            {
+                const double x = particles.x[i];
+                const double y = particles.y[i];
+                _escaped[i] = std::abs(x - mean[0]) > limit[0] || std::abs(y - mean[1]) > limit[1];
+                if (!_escaped[i])
+                {
+                    extent.add(x, y);
+                }
+            }
+            _extents[b] = extent;
+        });
+
+        Extent core;
+        for (const auto &extent : _extents)
+        {
+            core.merge(extent);
+        }
+        if (core.count == 0 || core.count == n)
+        {
+            return all;
+        }
+        for (std::uint32_t i = 0; i < n; ++i)
+        {
+            if (_escaped[i])
+            {
+                escapers.push_back(i);
+            }
+        }
+        return core;
+    }
+
+    /**
+     * Makes the root the smallest square holding the given extent.
+     */
+    void _set_root(const Extent &extent)
+    {
+        if (extent.count == 0)
+        {
+            return;
+        }
+        std::array<double, 2> center {0.5 * (extent.lo[0] + extent.hi[0]), 0.5 * (extent.lo[1] + extent.hi[1])};
+        double half = 0.5 * std::max(extent.hi[0] - extent.lo[0], extent.hi[1] - extent.lo[1]);
+        if (!(half > 0.0))
+        {
+            half = 1.0;  // a single position still needs a cell of nonzero size
+        }
+        ll = {center[0] - half, center[1] - half};
+        ur = {center[0] + half, center[1] + half};
+    }
+
+    /**
+     * Copies the current state into the back frame and makes it the latest one. Called at the end
+     * of a step by ParticleSystem::advance; never waits on readers of ParticleSystem::frames.
+     */
+    void publish()
+    {
+        auto &frame = frames.back();
+        frame.positions.resize(2 * particles.size());
+        for (std::size_t i = 0; i < particles.size(); ++i)
+        {
+            frame.positions[2 * i] = particles.x[i];
+            frame.positions[2 * i + 1] = particles.y[i];
+        }
+        frame.masses.assign(particles.m.begin(), particles.m.end());
+        frame.extents.clear();
+        if (publish_extents)
+        {
+            qt.get_extents(frame.extents);
+        }
+        frames.publish();
     }
 
     std::vector<std::array<double, 4>> get_extents()
@@ -71,5 +771,5 @@ struct ParticleSystem {
         return extents;
     }
 
-    std::vector<Particle> particles;
+    Particles<Scalar> particles;
 };
@@ -1,224 +1,887 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cstdint>
 #include <iostream>
-#include <memory>
+#include <vector>
 
+#include "kernels.h"
+#include "morton.h"
 #include "particle.h"
 
-struct QuadTree
+/**
+ * Node of the tree as it is built. Moments are accumulated in double precision whatever the scalar
+ * type of the particles, and rounded to it once the tree is flattened.
+ */
+struct QuadNode
 {
-    double theta = 0.5;
-
     std::array<double, 2> ll {-1.0, -1.0};
     std::array<double, 2> ur {1.0, 1.0};
 
-    Particle *particle {nullptr};
+    // bucket of a leaf: slots [first, first + capacity) of QuadTree::items, count of them in use
+    std::uint32_t first {0};
+    std::uint32_t count {0};
+    std::uint32_t capacity {0};
+
+    // indices into QuadTree::nodes in ne, nw, sw, se order; -1 marks an empty quadrant
+    std::array<std::int32_t, 4> children {-1, -1, -1, -1};
 
-    std::unique_ptr<QuadTree> ne {nullptr};
-    std::unique_ptr<QuadTree> nw {nullptr};
-    std::unique_ptr<QuadTree> sw {nullptr};
-    std::unique_ptr<QuadTree> se {nullptr};
+    std::array<double, 2> center {0.0, 0.0};            // center of the sources, weighted by absolute strength
+    double m {0.0};                                     // total strength: mass, or net charge
+    double weight {0.0};                                // total absolute strength
+    std::array<double, 2> dipole {0.0, 0.0};            // first moments x, y about center; zero for masses
+    std::array<double, 3> quadrupole {0.0, 0.0, 0.0};  // second moments xx, xy, yy about center
 
-    std::array<double, 2> center {0.0, 0.0};
-    double m {0.0};
+    bool is_leaf() const
+    {
+        return children[0] < 0 && children[1] < 0 && children[2] < 0 && children[3] < 0;
+    }
+};
 
-    std::unique_ptr<QuadTree>& _get_quadrant(Particle &e)
+/**
+ * Rounds the elements of an array to another scalar type.
+ */
+template <typename Scalar, typename Other, std::size_t N>
+inline std::array<Scalar, N> array_cast(const std::array<Other, N> &v)
+{
+    std::array<Scalar, N> result;
+    for (std::size_t i = 0; i < N; ++i)
     {
-        double dxh = 0.5 * (ur[0] + ll[0]);
-        double dyh = 0.5 * (ur[1] + ll[1]);
-        if (e.x > dxh && e.y >= dyh)
+        result[i] = static_cast<Scalar>(v[i]);
+    }
+    return result;
+}
+
+/**
+ * Node of the flattened tree. Nodes are stored in depth-first order, so the first child of a node
+ * directly follows it and skip points past its subtree.
+ */
+template <typename Scalar>
+struct FlatNode
+{
+    std::array<Scalar, 2> center {0.0, 0.0};
+    Scalar m {0.0};
+    std::array<Scalar, 3> quadrupole {0.0, 0.0, 0.0};
+    Scalar size {0.0};       // edge length of the cell
+    Scalar offset {0.0};     // distance from the geometric center of the cell to its center of gravity
+    std::int32_t skip {0};   // index of the next node outside this subtree; i + 1 for leaves
+    std::uint32_t first {0}; // bodies of this subtree: [first, first + count) of QuadTree::bodies
+    std::uint32_t count {0};
+};
+
+/**
+ * Positions and source strengths of the particles in the flattened tree, stored contiguously in
+ * depth-first order so each leaf bucket is evaluated as a direct sum over consecutive elements.
+ */
+template <typename Scalar>
+struct Bodies
+{
+    std::vector<Scalar> x;
+    std::vector<Scalar> y;
+    std::vector<Scalar> m;                // strength: mass, or charge
+    std::vector<std::uint32_t> particle;  // index of the particle each body was copied from
+
+    void clear()
+    {
+        x.clear();
+        y.clear();
+        m.clear();
+        particle.clear();
+    }
+
+    void push_back(const Particles<Scalar> &particles, const std::uint32_t e, const double strength)
+    {
+        x.push_back(particles.x[e]);
+        y.push_back(particles.y[e]);
+        m.push_back(strength);
+        particle.push_back(e);
+    }
+};
+
+/**
+ * Point sources of an interaction list.
+ */
+template <typename Scalar>
+struct Sources
+{
+    std::vector<Scalar> x;
+    std::vector<Scalar> y;
+    std::vector<Scalar> m;
+
+    void clear()
+    {
+        x.clear();
+        y.clear();
+        m.clear();
+    }
+
+    void push_back(const Scalar sx, const Scalar sy, const Scalar sm)
+    {
+        x.push_back(sx);
+        y.push_back(sy);
+        m.push_back(sm);
+    }
+};
+
+/**
+ * Sources gathered by a group walk: the accepted cells, with their first and second moments, and
+ * the bodies of the opened leaves.
+ */
+template <typename Scalar>
+struct InteractionList
+{
+    Sources<Scalar> cells;
+    std::vector<std::array<Scalar, 2>> dipole;
+    std::vector<std::array<Scalar, 3>> quadrupole;
+    Sources<Scalar> bodies;
+
+    void clear()
+    {
+        cells.clear();
+        dipole.clear();
+        quadrupole.clear();
+        bodies.clear();
+    }
+};
+
+enum class MultipoleOrder
+{
+    monopole,   // cells act as a point mass at their center of gravity
+    quadrupole  // cells add the field of their second mass moments
+};
+
+/**
+ * Barnes-Hut quadtree whose nodes live in a single arena. The arena keeps its capacity between
+ * steps, so rebuilding the tree via QuadTree::reset does not touch the heap once warmed up. The
+ * flattened tree and its bodies are stored in the scalar type of the particles, while the walks
+ * add up the accelerations of each particle in double precision.
+ */
+template <typename Scalar>
+struct QuadTree
+{
+    double theta = 0.5;
+    std::size_t bucket_size = 1;  // maximum number of particles held by a leaf above max_depth
+    std::size_t max_depth = 32;   // leaves at this depth never split and grow their bucket instead
+    ForceLaw law = ForceLaw::newtonian;
+    Softening softening = Softening::none;
+    double softening_length = 0.0;
+
+    Particles<Scalar> *particles {nullptr};     // particles the tree is built over
+    std::vector<QuadNode> nodes {QuadNode {}};  // node arena; nodes[0] is the root
+    std::vector<std::uint32_t> items;           // leaf bucket slots holding particle indices
+    MortonOrder morton;                         // sort buffers for QuadTree::build_morton
+    std::vector<FlatNode<Scalar>> flat;         // depth-first layout walked by QuadTree::force
+    std::vector<std::array<Scalar, 2>> dipoles; // dipole moments of QuadTree::flat, for charges only
+    Bodies<Scalar> bodies;                      // leaf particles of QuadTree::flat
+    std::vector<std::int32_t> groups;           // flat nodes walked once on behalf of all their bodies
+    bool flat_current = false;                  // whether QuadTree::flat lays out the current nodes
+
+    std::vector<std::int32_t> top;       // nodes above the frontier in breadth-first order
+    std::vector<std::int32_t> frontier;  // roots of the subtrees handed out as parallel tasks
+    std::vector<std::int32_t> _next;
+
+    /**
+     * Drops all nodes (keeping the allocation) and starts a new tree from an empty root.
+     *
+     * Arguments:
+     *     source: particles the tree is built over; they must outlive the tree
+     *     default_theta: Barnes-Hut opening parameter
+     *     leaf_size: maximum number of particles held by a leaf
+     *     depth_limit: depth below which leaves are not split, at most 64
+     *     ll: lower left corner of the root
+     *     ur: upper right corner of the root
+     */
+    void reset(Particles<Scalar> &source, const double default_theta, const std::size_t leaf_size, const std::size_t depth_limit, const std::array<double, 2> &ll, const std::array<double, 2> &ur)
+    {
+        particles = &source;
+        theta = default_theta;
+        bucket_size = std::max<std::size_t>(1, leaf_size);
+        // deeper cells would still split in double precision, but each level costs a frame of the
+        // recursive insertion, so coincident particles must not take the tree much further
+        max_depth = std::min<std::size_t>(depth_limit, 64);
+        items.clear();
+        nodes.clear();
+        nodes.push_back({ll, ur});
+        flat_current = false;
+    }
+
+    std::int32_t _child(const std::int32_t index, const std::size_t quadrant)
+    {
+        if (nodes[index].children[quadrant] < 0)
         {
-            if (!ne)
+            const auto ll = nodes[index].ll;
+            const auto ur = nodes[index].ur;
+            double dxh = 0.5 * (ur[0] + ll[0]);
+            double dyh = 0.5 * (ur[1] + ll[1]);
+
+            QuadNode child;
+            switch (quadrant)
             {
-                ne.reset(new QuadTree {theta, {dxh, dyh}, ur});
+            case 0:
+                child = {{dxh, dyh}, ur};
+                break;
+            case 1:
+                child = {{ll[0], dyh}, {dxh, ur[1]}};
+                break;
+            case 2:
+                child = {ll, {dxh, dyh}};
+                break;
+            default:
+                child = {{dxh, ll[1]}, {ur[0], dyh}};
+                break;
             }
-            return ne;
+            nodes[index].children[quadrant] = static_cast<std::int32_t>(nodes.size());
+            nodes.push_back(child);
         }
-        else if (e.x <= dxh && e.y > dyh)
+        return nodes[index].children[quadrant];
+    }
+
+    std::int32_t _get_quadrant(const std::int32_t index, const std::uint32_t e)
+    {
+        const auto &node = nodes[index];
+        double dxh = 0.5 * (node.ur[0] + node.ll[0]);
+        double dyh = 0.5 * (node.ur[1] + node.ll[1]);
+        double x = particles->x[e];
+        double y = particles->y[e];
+        if (x > dxh && y >= dyh)
         {
-            if (!nw)
+            return _child(index, 0);
+        }
+        else if (x <= dxh && y > dyh)
+        {
+            return _child(index, 1);
+        }
+        else if (x < dxh && y <= dyh)
+        {
+            return _child(index, 2);
+        }
+        else
+        {
+            return _child(index, 3);
+        }
+    }
+
+    void _grow(const std::int32_t index)
+    {
+        // relocate the bucket to the end of items with room for more particles
+        auto &node = nodes[index];
+        const auto first = static_cast<std::uint32_t>(items.size());
+        node.capacity = std::max<std::uint32_t>(static_cast<std::uint32_t>(bucket_size), 2 * node.capacity);
+        items.resize(items.size() + node.capacity);
+        std::copy_n(items.begin() + node.first, node.count, items.begin() + first);
+        node.first = first;
+    }
+
+    void _subdivide(const std::int32_t index, const std::uint32_t e, const std::size_t depth)
+    {
+        // the abandoned slots are reclaimed by the next QuadTree::reset
+        const auto first = nodes[index].first;
+        const auto count = nodes[index].count;
+        nodes[index].count = 0;
+        nodes[index].capacity = 0;
+        for (auto i = first; i < first + count; ++i)
+        {
+            const auto _particle = items[i];
+            add(_particle, _get_quadrant(index, _particle), depth + 1);
+        }
+        add(e, _get_quadrant(index, e), depth + 1);
+    }
+
+    void add(const std::uint32_t e, const std::int32_t index = 0, const std::size_t depth = 0)
+    {
+        auto &node = nodes[index];
+        if (!node.is_leaf())
+        {
+            add(e, _get_quadrant(index, e), depth + 1);
+        }
+        else if (node.count >= bucket_size && depth < max_depth)
+        {
+            _subdivide(index, e, depth);
+        }
+        else
+        {
+            if (node.count == node.capacity)
             {
-                nw.reset(new QuadTree {theta, {ll[0], dyh}, {dxh, ur[1]}});
+                _grow(index);
             }
-            return nw;
+            auto &leaf = nodes[index];
+            items[leaf.first + leaf.count++] = e;
         }
-        else if (e.x < dxh && e.y <= dyh)
+    }
+
+    /**
+     * Builds the tree below the root from the particles ordered by Morton key rather than by
+     * inserting them one at a time. The key computation and sort are split into blocks handed to
+     * the parallel callable; the hierarchy is then laid out with one pass over the sorted keys.
+     *
+     * Arguments:
+     *     parallel: callable executing task(i) for every i in [0, count)
+     *     blocks: number of blocks to split the sort into
+     *     keep: predicate on particle indices selecting the particles to add
+     */
+    template <typename Parallel, typename Keep>
+    void build_morton(Parallel &&parallel, const std::size_t blocks, Keep &&keep)
+    {
+        morton.sort(*particles, nodes[0].ll, nodes[0].ur, parallel, blocks);
+        items.clear();
+        for (std::size_t i = 0; i < morton.indices.size(); ++i)
         {
-            if (!sw)
+            // the kept keys are compacted in place, staying sorted
+            if (keep(morton.indices[i]))
             {
-                sw.reset(new QuadTree {theta, ll, {dxh, dyh}});
+                morton.keys[items.size()] = morton.keys[i];
+                items.push_back(morton.indices[i]);
             }
-            return sw;
         }
-        else
+        if (!items.empty())
+        {
+            _add_sorted(0, 0, items.size(), 0);
+        }
+    }
+
+    void _add_sorted(const std::int32_t index, std::size_t begin, const std::size_t end, const std::size_t level)
+    {
+        if (end - begin <= bucket_size || level == std::min<std::size_t>(max_depth, morton_bits))
         {
-            if (!se)
+            // sorted particles of a leaf are already contiguous in items, including overflowing
+            // leaves at the depth limit or where the keys run out of bits
+            auto &node = nodes[index];
+            node.first = static_cast<std::uint32_t>(begin);
+            node.count = static_cast<std::uint32_t>(end - begin);
+            node.capacity = node.count;
+            return;
+        }
+
+        // Morton digit (y << 1) | x to quadrant index: sw, se, nw, ne
+        constexpr std::array<std::size_t, 4> quadrants {2, 3, 1, 0};
+        const auto shift = 2 * (morton_bits - 1 - level);
+        const auto keys = morton.keys.begin();
+        for (std::uint64_t digit = 0; digit < 4 && begin < end; ++digit)
+        {
+            std::size_t split = std::partition_point(keys + begin, keys + end, [=](const std::uint64_t key) {
+                return ((key >> shift) & 3) <= digit;
+            }) - keys;
+            if (split > begin)
             {
-                se.reset(new QuadTree {theta, {dxh, ll[1]}, {ur[0], dyh}});
+                _add_sorted(_child(index, quadrants[digit]), begin, split, level + 1);
             }
-            return se;
+            begin = split;
         }
     }
 
-    void _subdivide(Particle &e)
+    /**
+     * Strength of a particle as a source, as set by the force law of the tree.
+     */
+    double _strength(const std::uint32_t e) const
     {
-        auto &existing_particle_quadrant = _get_quadrant(*particle);
-        auto _particle = particle;
-        particle = nullptr;
-        existing_particle_quadrant->add(*_particle);
-
-        auto &new_particle_quadrant = _get_quadrant(e);
-        new_particle_quadrant->add(e);
+        return law == ForceLaw::coulomb ? particles->q[e] : particles->m[e];
     }
 
-    void add(Particle &e)
+    /**
+     * Divides the weighted sum of positions accumulated in a node's center by its weight. Nodes
+     * without any weight, e.g. of neutral particles only, are centered on their cell.
+     */
+    void _center(QuadNode &node)
     {
-        if (ne || nw || sw || se)
+        if (node.weight > 0.0)
         {
-            auto &particle_quadrant = _get_quadrant(e);
-            particle_quadrant->add(e);
+            node.center[0] /= node.weight;
+            node.center[1] /= node.weight;
         }
-        else if (particle)
+        else
         {
-            _subdivide(e);
+            node.center = {0.5 * (node.ll[0] + node.ur[0]), 0.5 * (node.ll[1] + node.ur[1])};
         }
-        else
+    }
+
+    void _aggregate(QuadNode &node)
+    {
+        node.m = 0.0;
+        node.weight = 0.0;
+        node.center = {0.0, 0.0};
+        for (auto c : node.children)
+        {
+            if (c >= 0)
+            {
+                const auto &child = nodes[c];
+                node.center[0] += child.center[0] * child.weight;
+                node.center[1] += child.center[1] * child.weight;
+                node.m += child.m;
+                node.weight += child.weight;
+            }
+        }
+        _center(node);
+
+        // parallel axis theorem moves each child's moments onto the new center
+        node.dipole = {0.0, 0.0};
+        node.quadrupole = {0.0, 0.0, 0.0};
+        for (auto c : node.children)
         {
-            particle = &e;
+            if (c >= 0)
+            {
+                const auto &child = nodes[c];
+                double dx = child.center[0] - node.center[0];
+                double dy = child.center[1] - node.center[1];
+                if (law == ForceLaw::coulomb)
+                {
+                    node.dipole[0] += child.dipole[0] + child.m * dx;
+                    node.dipole[1] += child.dipole[1] + child.m * dy;
+                    node.quadrupole[0] += child.quadrupole[0] + 2.0 * child.dipole[0] * dx + child.m * dx * dx;
+                    node.quadrupole[1] += child.quadrupole[1] + child.dipole[0] * dy + child.dipole[1] * dx + child.m * dx * dy;
+                    node.quadrupole[2] += child.quadrupole[2] + 2.0 * child.dipole[1] * dy + child.m * dy * dy;
+                }
+                else
+                {
+                    node.quadrupole[0] += child.quadrupole[0] + child.m * dx * dx;
+                    node.quadrupole[1] += child.quadrupole[1] + child.m * dx * dy;
+                    node.quadrupole[2] += child.quadrupole[2] + child.m * dy * dy;
+                }
+            }
         }
     }
 
-    void get_cogs()
+    /**
+     * Computes the strength, center and moments of a subtree. Masses are centered on their center
+     * of gravity, which leaves them without dipole; signed charges are centered by absolute charge
+     * and keep theirs.
+     *
+     * Arguments:
+     *     index: root of the subtree
+     */
+    void get_cogs(const std::int32_t index = 0)
     {
-        if (particle)
+        auto &node = nodes[index];
+        if (node.is_leaf())
         {
-            m = particle->m;
-            center = {particle->x, particle->y};
+            const auto &x = particles->x;
+            const auto &y = particles->y;
+            node.m = 0.0;
+            node.weight = 0.0;
+            node.center = {0.0, 0.0};
+            for (auto i = node.first; i < node.first + node.count; ++i)
+            {
+                const double s = _strength(items[i]);
+                node.center[0] += x[items[i]] * std::abs(s);
+                node.center[1] += y[items[i]] * std::abs(s);
+                node.m += s;
+                node.weight += std::abs(s);
+            }
+            _center(node);
+
+            node.dipole = {0.0, 0.0};
+            node.quadrupole = {0.0, 0.0, 0.0};
+            for (auto i = node.first; i < node.first + node.count; ++i)
+            {
+                const double s = _strength(items[i]);
+                double dx = x[items[i]] - node.center[0];
+                double dy = y[items[i]] - node.center[1];
+                if (law == ForceLaw::coulomb)
+                {
+                    node.dipole[0] += s * dx;
+                    node.dipole[1] += s * dy;
+                }
+                node.quadrupole[0] += s * dx * dx;
+                node.quadrupole[1] += s * dx * dy;
+                node.quadrupole[2] += s * dy * dy;
+            }
         }
         else
         {
-            m = 0.0;
-            center = {0.0, 0.0};
-            if (ne)
+            for (auto c : node.children)
             {
-                ne->get_cogs();
-                center[0] += ne->center[0] * ne->m;
-                center[1] += ne->center[1] * ne->m;
-                m += ne->m;
+                if (c >= 0)
+                {
+                    get_cogs(c);
+                }
             }
-            if (nw)
+            _aggregate(node);
+        }
+    }
+
+    /**
+     * Splits the tree into QuadTree::top and QuadTree::frontier, expanding level by level until
+     * there are a few subtrees per task to even out their sizes.
+     *
+     * Arguments:
+     *     concurrency: number of tasks run at once
+     */
+    void partition(const std::size_t concurrency)
+    {
+        top.clear();
+        frontier.assign(1, 0);
+        while (frontier.size() < 4 * concurrency)
+        {
+            _next.clear();
+            for (auto index : frontier)
             {
-                nw->get_cogs();
-                center[0] += nw->center[0] * nw->m;
-                center[1] += nw->center[1] * nw->m;
-                m += nw->m;
+                if (nodes[index].is_leaf())
+                {
+                    _next.push_back(index);
+                    continue;
+                }
+                top.push_back(index);
+                for (auto c : nodes[index].children)
+                {
+                    if (c >= 0)
+                    {
+                        _next.push_back(c);
+                    }
+                }
             }
-            if (sw)
+            frontier.swap(_next);
+            if (frontier == _next)
             {
-                sw->get_cogs();
-                center[0] += sw->center[0] * sw->m;
-                center[1] += sw->center[1] * sw->m;
-                m += sw->m;
+                break;  // only leaves left
             }
-            if (se)
+        }
+    }
+
+    /**
+     * Computes the centers of gravity with the subtrees below the top few levels handed out as
+     * parallel tasks. The top levels are then aggregated bottom-up on the calling thread.
+     *
+     * Arguments:
+     *     parallel: callable executing task(i) for every i in [0, count)
+     *     concurrency: number of tasks the callable runs at once
+     */
+    template <typename Parallel>
+    void get_cogs(Parallel &&parallel, const std::size_t concurrency)
+    {
+        partition(concurrency);
+
+        parallel(frontier.size(), [this](const std::size_t i) {
+            get_cogs(frontier[i]);
+        });
+
+        // top is in breadth-first order, so children are aggregated before their parents
+        for (auto it = top.rbegin(); it != top.rend(); ++it)
+        {
+            _aggregate(nodes[*it]);
+        }
+    }
+
+    /**
+     * Flattens the tree into QuadTree::flat in depth-first order. Must be called after the centers
+     * of gravity are computed and before QuadTree::force.
+     */
+    void compile()
+    {
+        flat.clear();
+        dipoles.clear();
+        bodies.clear();
+        _compile(0);
+        flat_current = true;
+    }
+
+    void _compile(const std::int32_t index)
+    {
+        const auto &node = nodes[index];
+        const auto position = flat.size();
+        double offset = std::hypot(node.center[0] - 0.5 * (node.ll[0] + node.ur[0]), node.center[1] - 0.5 * (node.ll[1] + node.ur[1]));
+        flat.push_back({array_cast<Scalar>(node.center), static_cast<Scalar>(node.m), array_cast<Scalar>(node.quadrupole), static_cast<Scalar>(node.ur[0] - node.ll[0]), static_cast<Scalar>(offset), 0, static_cast<std::uint32_t>(bodies.x.size())});
+        if (law == ForceLaw::coulomb)
+        {
+            dipoles.push_back(array_cast<Scalar>(node.dipole));
+        }
+        for (auto i = node.first; i < node.first + node.count; ++i)
+        {
+            bodies.push_back(*particles, items[i], _strength(items[i]));
+        }
+        for (auto c : node.children)
+        {
+            if (c >= 0)
             {
-                se->get_cogs();
-                center[0] += se->center[0] * se->m;
-                center[1] += se->center[1] * se->m;
-                m += se->m;
+                _compile(c);
             }
-            center[0] /= m;
-            center[1] /= m;
         }
+        auto &compiled = flat[position];
+        compiled.skip = static_cast<std::int32_t>(flat.size());
+        compiled.count = static_cast<std::uint32_t>(bodies.x.size()) - compiled.first;
+    }
+
+    /**
+     * Updates the flattened tree for particles that moved since it was built, keeping its
+     * topology: moments and bodies are taken from the current positions, and every cell grows to
+     * the box around the particles that drifted out of it, so the opening test stays
+     * conservative. Much cheaper than a rebuild for the short drifts between substeps. A tree
+     * not compiled since it was built is compiled instead.
+     *
+     * Arguments:
+     *     parallel: callable executing task(i) for every i in [0, count)
+     *     concurrency: number of tasks the callable runs at once
+     */
+    template <typename Parallel>
+    void refit(Parallel &&parallel, const std::size_t concurrency)
+    {
+        get_cogs(parallel, concurrency);
+        if (!flat_current)
+        {
+            compile();
+            return;
+        }
+        std::size_t position = 0;
+        _refit(0, position);
     }
 
-   void force(Particle &e)
-   {
-        if (particle)
+    std::array<double, 4> _refit(const std::int32_t index, std::size_t &position)
+    {
+        const auto &node = nodes[index];
+        if (law == ForceLaw::coulomb)
+        {
+            dipoles[position] = array_cast<Scalar>(node.dipole);
+        }
+        auto &compiled = flat[position++];
+        std::array<double, 4> box {node.ll[0], node.ll[1], node.ur[0], node.ur[1]};
+        for (auto b = compiled.first; b < compiled.first + node.count; ++b)
+        {
+            bodies.x[b] = particles->x[bodies.particle[b]];
+            bodies.y[b] = particles->y[bodies.particle[b]];
+            box = {std::min<double>(box[0], bodies.x[b]), std::min<double>(box[1], bodies.y[b]), std::max<double>(box[2], bodies.x[b]), std::max<double>(box[3], bodies.y[b])};
+        }
+        for (auto c : node.children)
         {
-            if (particle != &e)
+            if (c >= 0)
             {
-               e.force(*particle);
+                const auto child = _refit(c, position);
+                box = {std::min(box[0], child[0]), std::min(box[1], child[1]), std::max(box[2], child[2]), std::max(box[3], child[3])};
             }
         }
-        else
-        {
-            double dx = center[0] - e.x;
-            double dy = center[1] - e.y;
-            double d = std::hypot(dx, dy);
+        compiled.center = array_cast<Scalar>(node.center);
+        compiled.m = static_cast<Scalar>(node.m);
+        compiled.quadrupole = array_cast<Scalar>(node.quadrupole);
+        compiled.size = static_cast<Scalar>(std::max(box[2] - box[0], box[3] - box[1]));
+        compiled.offset = static_cast<Scalar>(std::hypot(node.center[0] - 0.5 * (box[0] + box[2]), node.center[1] - 0.5 * (box[1] + box[3])));
+        return box;
+    }
 
-            if ((ur[0] - ll[0]) / d < theta)
+    /**
+     * Adds the acceleration of a particle caused by the tree and returns the number of
+     * interactions it took, i.e. accepted cells plus bodies of opened leaves.
+     *
+     * Arguments:
+     *     e: index of the particle
+     *     order: multipole order of accepted cells
+     */
+    std::uint32_t force(const std::uint32_t e, const MultipoleOrder order = MultipoleOrder::monopole) const
+    {
+        return dispatch_kernel(law, softening, [&](auto kernel) {
+            using K = decltype(kernel);
+            if (order == MultipoleOrder::quadrupole)
             {
-                e.force(dx, dy, m);
+                return _force<true, K>(e);
             }
-            else
+            return _force<false, K>(e);
+        });
+    }
+
+    template <bool Quadrupole, typename K>
+    std::uint32_t _force(const std::uint32_t e) const
+    {
+        std::uint32_t interactions = 0;
+        const Scalar x = particles->x[e];
+        const Scalar y = particles->y[e];
+        const double coupling = K::coupling(*particles, e);
+        double ax = particles->ax[e];
+        double ay = particles->ay[e];
+        const auto count = static_cast<std::int32_t>(flat.size());
+        std::int32_t i = 0;
+        while (i < count)
+        {
+            const auto &node = flat[i];
+            Scalar dx = node.center[0] - x;
+            Scalar dy = node.center[1] - y;
+            // the offset keeps cells whose mass sits near their edge from being accepted too early
+            if (node.size < theta * (std::hypot(dx, dy) - node.offset))
             {
-                if (ne)
-                {
-                    ne->force(e);
-                }
-                if (nw)
+                point_force<K>(dx, dy, node.m, softening_length, coupling, ax, ay);
+                if constexpr (K::law == ForceLaw::coulomb)
                 {
-                    nw->force(e);
+                    dipole_force<K>(dx, dy, dipoles[i], softening_length, coupling, ax, ay);
                 }
-                if (sw)
+                if constexpr (Quadrupole)
                 {
-                    sw->force(e);
-                }
-                if (se)
-                {
-                    se->force(e);
+                    quadrupole_force<K>(dx, dy, node.quadrupole, softening_length, coupling, ax, ay);
                 }
+                ++interactions;
+                i = node.skip;
+            }
+            else if (node.skip == i + 1)
+            {
+                // leaf: direct sum over its bucket, skipping e itself and coincident particles
+                force_kernel<K, Scalar>(&bodies.x[node.first], &bodies.y[node.first], &bodies.m[node.first], node.count, x, y, softening_length, coupling, ax, ay);
+                interactions += node.count;
+                i = node.skip;
+            }
+            else
+            {
+                ++i;
             }
         }
+        particles->ax[e] = static_cast<Scalar>(ax);
+        particles->ay[e] = static_cast<Scalar>(ay);
+        return interactions;
     }
 
-    void get_extents(std::vector<std::array<double, 4>> &extents)
+    /**
+     * Splits the flattened tree into groups: the largest subtrees holding at most group_size bodies
+     * (or single leaves exceeding it).
+     *
+     * Arguments:
+     *     group_size: maximum number of bodies sharing one walk
+     */
+    void find_groups(const std::size_t group_size)
     {
-        if (particle)
+        groups.clear();
+        const auto count = static_cast<std::int32_t>(flat.size());
+        std::int32_t i = 0;
+        while (i < count)
         {
-            extents.push_back({ll[0], ll[1], ur[0], ur[1]});
-        }
-        if (ne)
-        {
-            ne->get_extents(extents);
+            const auto &node = flat[i];
+            if (node.count <= group_size || node.skip == i + 1)
+            {
+                if (node.count)
+                {
+                    groups.push_back(i);
+                }
+                i = node.skip;
+            }
+            else
+            {
+                ++i;
+            }
         }
-        if (nw)
+    }
+
+    /**
+     * Walks the tree once for all bodies of a group and applies the gathered interactions to each
+     * of them. Cells are accepted against the bounding box of the group, which makes the opening
+     * test hold for every member.
+     *
+     * Arguments:
+     *     group: index into QuadTree::groups
+     *     list: scratch space for the interaction list
+     *     order: multipole order of accepted cells
+     */
+    void group_force(const std::size_t group, InteractionList<Scalar> &list, const MultipoleOrder order = MultipoleOrder::monopole) const
+    {
+        dispatch_kernel(law, softening, [&](auto kernel) {
+            using K = decltype(kernel);
+            if (order == MultipoleOrder::quadrupole)
+            {
+                _group_force<true, K>(flat[groups[group]], list);
+            }
+            else
+            {
+                _group_force<false, K>(flat[groups[group]], list);
+            }
+        });
+    }
+
+    template <bool Quadrupole, typename K>
+    void _group_force(const FlatNode<Scalar> &group, InteractionList<Scalar> &list) const
+    {
+        std::array<Scalar, 2> lo {bodies.x[group.first], bodies.y[group.first]};
+        std::array<Scalar, 2> hi = lo;
+        for (auto j = group.first; j < group.first + group.count; ++j)
         {
-            nw->get_extents(extents);
+            lo = {std::min(lo[0], bodies.x[j]), std::min(lo[1], bodies.y[j])};
+            hi = {std::max(hi[0], bodies.x[j]), std::max(hi[1], bodies.y[j])};
         }
-        if (sw)
+
+        list.clear();
+        const auto count = static_cast<std::int32_t>(flat.size());
+        std::int32_t i = 0;
+        while (i < count)
         {
-            sw->get_extents(extents);
+            const auto &node = flat[i];
+            Scalar dx = std::max<Scalar>({lo[0] - node.center[0], 0.0, node.center[0] - hi[0]});
+            Scalar dy = std::max<Scalar>({lo[1] - node.center[1], 0.0, node.center[1] - hi[1]});
+            if (node.size < theta * (std::hypot(dx, dy) - node.offset))
+            {
+                list.cells.push_back(node.center[0], node.center[1], node.m);
+                if constexpr (K::law == ForceLaw::coulomb)
+                {
+                    list.dipole.push_back(dipoles[i]);
+                }
+                if constexpr (Quadrupole)
+                {
+                    list.quadrupole.push_back(node.quadrupole);
+                }
+                i = node.skip;
+            }
+            else if (node.skip == i + 1)
+            {
+                for (auto j = node.first; j < node.first + node.count; ++j)
+                {
+                    list.bodies.push_back(bodies.x[j], bodies.y[j], bodies.m[j]);
+                }
+                i = node.skip;
+            }
+            else
+            {
+                ++i;
+            }
         }
-        if (se)
+
+        for (auto b = group.first; b < group.first + group.count; ++b)
         {
-            se->get_extents(extents);
+            const auto e = bodies.particle[b];
+            const Scalar x = bodies.x[b];
+            const Scalar y = bodies.y[b];
+            double ax = particles->ax[e];
+            double ay = particles->ay[e];
+            const double coupling = K::coupling(*particles, e);
+            force_kernel<K, Scalar>(list.cells.x.data(), list.cells.y.data(), list.cells.m.data(), list.cells.x.size(), x, y, softening_length, coupling, ax, ay);
+            force_kernel<K, Scalar>(list.bodies.x.data(), list.bodies.y.data(), list.bodies.m.data(), list.bodies.x.size(), x, y, softening_length, coupling, ax, ay);
+            if constexpr (K::law == ForceLaw::coulomb)
+            {
+                for (std::size_t j = 0; j < list.dipole.size(); ++j)
+                {
+                    dipole_force<K>(list.cells.x[j] - x, list.cells.y[j] - y, list.dipole[j], softening_length, coupling, ax, ay);
+                }
+            }
+            if constexpr (Quadrupole)
+            {
+                for (std::size_t j = 0; j < list.quadrupole.size(); ++j)
+                {
+                    quadrupole_force<K>(list.cells.x[j] - x, list.cells.y[j] - y, list.quadrupole[j], softening_length, coupling, ax, ay);
+                }
+            }
+            particles->ax[e] = static_cast<Scalar>(ax);
+            particles->ay[e] = static_cast<Scalar>(ay);
         }
     }
 
-    void print()
+    void get_extents(std::vector<std::array<double, 4>> &extents, const std::int32_t index = 0)
     {
-        if (ne)
-        {
-            ne->print();
-        }
-        if (nw)
+        const auto &node = nodes[index];
+        if (node.count)
         {
-            nw->print();
+            extents.push_back({node.ll[0], node.ll[1], node.ur[0], node.ur[1]});
         }
-        if (sw)
+        for (auto c : node.children)
         {
-            sw->print();
+            if (c >= 0)
+            {
+                get_extents(extents, c);
+            }
         }
-        if (se)
+    }
+
+    void print(const std::int32_t index = 0)
+    {
+        const auto &node = nodes[index];
+        for (auto c : node.children)
         {
-            se->print();
+            if (c >= 0)
+            {
+                print(c);
+            }
         }
-        if (particle)
+        if (node.count)
         {
-            std::cout << ll[0] << " " << ll[1] << " " << ur[0] << " " << ur[1] << std::endl;
+            std::cout << node.ll[0] << " " << node.ll[1] << " " << node.ur[0] << " " << node.ur[1] << std::endl;
         }
     }
 };
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Tasks spawned into a TaskPool that are waited on together. Tasks may spawn further tasks into
+ * the group they belong to, building a tree that TaskPool::wait waits on as a whole.
+ */
+struct TaskGroup
+{
+    std::atomic<std::size_t> pending {0};  // tasks spawned and not yet completed
+};
+
+/**
+ * A work-stealing thread pool. Every thread has its own deque of tasks: it pushes and pops tasks
+ * at the back, while idle threads steal from the front of the others. Threads waiting on a group
+ * run pending tasks instead of blocking, so the thread calling into the pool works alongside the
+ * workers and nested waits do not deadlock.
+ */
+struct TaskPool
+{
+    using Task = std::function<void(void)>;
+
+    /**
+     * Creates the workers. The calling thread takes part in the work, so one fewer worker thread
+     * than the requested concurrency is started.
+     *
+     * Arguments:
+     *     nthreads: number of threads executing tasks at once
+     */
+    TaskPool(const std::size_t nthreads):
+        num_threads(std::max<std::size_t>(1, nthreads)),
+        queues(num_threads)
+    {
+        workers.reserve(num_threads - 1);
+        for (std::size_t i = 1; i < num_threads; ++i)
+        {
+            workers.emplace_back(&TaskPool::worker, std::ref(*this), i);
+        }
+    }
+
+    /**
+     * Wakes and joins the workers. Pending tasks must have been waited on before.
+     */
+    ~TaskPool()
+    {
+        {
+            std::lock_guard guard(sleep_mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        workers.clear();
+    }
+
+    /**
+     * Schedules a task as part of a group. It is pushed onto the deque of the calling thread.
+     *
+     * Arguments:
+     *     group: group to complete the task in
+     *     task: function to execute
+     */
+    void spawn(TaskGroup &group, Task task)
+    {
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+        auto &queue = queues[_slot()];
+        {
+            std::lock_guard guard(queue.mutex);
+            queue.tasks.push_back([&group, task = std::move(task)]() {
+                task();
+                group.pending.fetch_sub(1, std::memory_order_release);
+            });
+            queued.fetch_add(1);
+        }
+        if (sleeping.load() > 0)
+        {
+            std::lock_guard guard(sleep_mutex);
+            wakeup.notify_one();
+        }
+    }
+
+    /**
+     * Runs pending tasks until every task of the group, including those spawned by its tasks, has
+     * completed.
+     *
+     * Arguments:
+     *     group: group to wait on
+     */
+    void wait(TaskGroup &group)
+    {
+        while (group.pending.load(std::memory_order_acquire) > 0)
+        {
+            if (!_run_one())
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * Executes body(i) for every i in [0, count) and returns once all have completed. The range is
+     * split in halves down to the grain size; the halves handed out are what idle threads steal,
+     * so uneven iterations balance out between threads.
+     *
+     * Arguments:
+     *     count: number of iterations
+     *     body: function to execute for each index
+     *     grain: largest number of consecutive iterations run as one task
+     */
+    void parallel_for(const std::size_t count, const std::function<void(std::size_t)> &body, const std::size_t grain = 1)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        TaskGroup group;
+        _split(group, 0, count, std::max<std::size_t>(1, grain), body);
+        wait(group);
+    }
+
+    /**
+     * Executes body(begin, end) over consecutive chunks covering [0, count) and returns once all
+     * have completed. Chunks are handed out in order from an atomic counter to one draining task
+     * per thread, so threads that finish early simply take more chunks.
+     *
+     * Arguments:
+     *     count: number of iterations
+     *     grain: number of iterations per chunk; the last chunk takes the remainder
+     *     body: function to execute for each chunk
+     */
+    void parallel_chunks(const std::size_t count, const std::size_t grain, const std::function<void(std::size_t, std::size_t)> &body)
+    {
+        const auto chunk = std::max<std::size_t>(1, grain);
+        std::atomic<std::size_t> next {0};
+        auto drain = [&]() {
+            for (auto begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk))
+            {
+                body(begin, std::min(count, begin + chunk));
+            }
+        };
+
+        TaskGroup group;
+        const auto chunks = (count + chunk - 1) / chunk;
+        for (std::size_t i = 1; i < std::min(num_threads, chunks); ++i)
+        {
+            spawn(group, drain);
+        }
+        drain();
+        wait(group);
+    }
+
+    void _split(TaskGroup &group, const std::size_t begin, std::size_t end, const std::size_t grain, const std::function<void(std::size_t)> &body)
+    {
+        while (end - begin > grain)
+        {
+            const auto middle = begin + (end - begin) / 2;
+            spawn(group, [this, &group, middle, end, grain, &body]() {
+                _split(group, middle, end, grain, body);
+            });
+            end = middle;
+        }
+        for (auto i = begin; i < end; ++i)
+        {
+            body(i);
+        }
+    }
+
+    /**
+     * Index of the deque of the calling thread. Threads outside the pool share the first one.
+     */
+    std::size_t _slot() const
+    {
+        return current_pool == this ? current_slot : 0;
+    }
+
+    /**
+     * Runs one task, taken from the back of the own deque or else stolen from the front of
+     * another. Returns false if every deque was empty.
+     */
+    bool _run_one()
+    {
+        const auto slot = _slot();
+        Task task;
+        for (std::size_t k = 0; k < num_threads && !task; ++k)
+        {
+            auto &queue = queues[(slot + k) % num_threads];
+            std::lock_guard guard(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                if (k == 0)
+                {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                }
+                else
+                {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+                queued.fetch_sub(1);
+            }
+        }
+        if (!task)
+        {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+    /**
+     * Loop of the worker threads: run tasks while there are any, spin for a while once they run
+     * out so the next parallel section starts without a wake up, then sleep until a task is
+     * spawned.
+     *
+     * Arguments:
+     *     slot: index of the deque owned by the worker
+     */
+    void worker(const std::size_t slot)
+    {
+        current_pool = this;
+        current_slot = slot;
+        while (true)
+        {
+            for (std::size_t spin = 0; spin < spin_limit; ++spin)
+            {
+                if (_run_one())
+                {
+                    spin = 0;
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+
+            std::unique_lock lock(sleep_mutex);
+            sleeping.fetch_add(1);
+            wakeup.wait(lock, [this]() { return stopping || queued.load() > 0; });
+            sleeping.fetch_sub(1);
+            if (stopping)
+            {
+                break;
+            }
+        }
+    }
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    static constexpr std::size_t spin_limit = 1 << 12;  // failed steal attempts before sleeping
+
+    static inline thread_local const TaskPool *current_pool {nullptr};  // pool the thread works for
+    static inline thread_local std::size_t current_slot {0};            // deque owned by the thread
+
+    std::size_t num_threads {1};            // number of threads executing tasks, including callers
+    std::vector<Queue> queues;              // one deque per thread; callers share the first
+    std::atomic<std::size_t> queued {0};    // tasks in all deques
+    std::atomic<std::size_t> sleeping {0};  // workers waiting on wakeup
+    std::mutex sleep_mutex;                 // guards stopping and the wakeup wait
+    std::condition_variable wakeup;         // signalled when tasks are spawned or on shutdown
+    bool stopping {false};                  // flag to signal ending the workers
+    std::vector<std::jthread> workers;      // worker threads, declared last to join first
+};
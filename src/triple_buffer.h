@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Hands values from a single writer to a single reader without either of them waiting on the
+ * other. Each side owns one of three buffers and the third is swapped between them: the writer
+ * fills its back buffer and publishes it in exchange for the spare one, the reader takes the
+ * latest published buffer in exchange for the one it was reading. Values published while the
+ * reader is busy are dropped in favour of newer ones.
+ */
+template <typename T>
+struct TripleBuffer
+{
+    static constexpr std::uint8_t fresh = 4;  // set on the middle index while it is unread
+    static constexpr std::uint8_t index_mask = 3;
+
+    std::array<T, 3> buffers;
+    std::atomic<std::uint8_t> _middle {1};  // index of the buffer between writer and reader
+    std::uint8_t _back {0};                 // index of the buffer owned by the writer
+    std::uint8_t _front {2};                // index of the buffer owned by the reader
+
+    /**
+     * Buffer to fill with the next value. Only to be used by the writer.
+     */
+    T &back()
+    {
+        return buffers[_back];
+    }
+
+    /**
+     * Makes the back buffer the latest value and hands the writer a new back buffer, which holds
+     * an older value to overwrite.
+     */
+    void publish()
+    {
+        _back = _middle.exchange(_back | fresh, std::memory_order_acq_rel) & index_mask;
+    }
+
+    /**
+     * Latest published value. It stays valid and unchanged until the next call. Only to be used by
+     * the reader.
+     */
+    const T &front()
+    {
+        if (_middle.load(std::memory_order_relaxed) & fresh)
+        {
+            _front = _middle.exchange(_front, std::memory_order_acq_rel) & index_mask;
+        }
+        return buffers[_front];
+    }
+};